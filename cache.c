@@ -0,0 +1,369 @@
+/* cache.c
+ *
+ * Copyright (C) 2025 Timo Kokkonen
+ * All Rights Reserved.
+ *
+ * Persistent result cache (--cache), to skip files already processed by earlier runs.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of JPEGoptim.
+ *
+ * JPEGoptim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JPEGoptim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JPEGoptim. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#include "jpegoptim.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#define CACHE_MAGIC   0x3245484341434a4aULL	/* "JJCACHE2" */
+#define FNV_OFFSET    0xcbf29ce484222325ULL
+#define FNV_PRIME     0x100000001b3ULL
+
+
+/*
+ * Cache file consists of fixed size records that are only ever appended
+ * (with a single write() call each, so that concurrent workers, and other
+ * jpegoptim processes, can add records to the same file). Newer records
+ * override older ones with the same key (file and options), and the file
+ * is compacted when it is opened, if most of the records are superseded.
+ */
+struct cache_record {
+	uint64_t magic;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t  mtime;		/* modification time (ns) */
+	uint64_t options;	/* hash of options that affect the output */
+	unsigned char content[SHA256_SIZE];	/* digest of the file contents */
+	uint32_t result;	/* CACHE_OPTIMIZED or CACHE_SKIPPED */
+	uint32_t check;		/* checksum of the record (to detect partial writes) */
+};
+
+
+static struct cache_record *records = NULL;
+static size_t record_count = 0;
+static size_t record_size = 0;
+static size_t *stat_index = NULL;	/* hash tables of record numbers (+1) */
+static size_t *content_index = NULL;
+static size_t index_size = 0;
+static size_t superseded = 0;		/* records replaced by newer ones */
+static uint64_t cache_options = 0;
+static int cache_fd = -1;
+
+
+
+uint64_t content_hash(uint64_t h, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	/* FNV-1a */
+	if (h == 0)
+		h = FNV_OFFSET;
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= FNV_PRIME;
+	}
+
+	return h;
+}
+
+
+int content_digest_file(const char *filename, unsigned char *digest)
+{
+	unsigned char buf[64 * 1024];
+	struct sha256_ctx ctx;
+	ssize_t r;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	sha256_init(&ctx);
+	while ((r = read(fd, buf, sizeof(buf))) != 0) {
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			return -1;
+		}
+		sha256_update(&ctx, buf, r);
+	}
+	close(fd);
+	sha256_final(&ctx, digest);
+
+	return 0;
+}
+
+
+static uint32_t record_check(const struct cache_record *r)
+{
+	return (uint32_t)content_hash(0, r, offsetof(struct cache_record, check));
+}
+
+
+static size_t stat_slot(uint64_t dev, uint64_t ino, uint64_t options)
+{
+	return (size_t)((((dev * FNV_PRIME) ^ ino) * FNV_PRIME) ^ options) & (index_size - 1);
+}
+
+
+static size_t content_slot(uint64_t size, const unsigned char *content, uint64_t options)
+{
+	uint64_t h;
+
+	memcpy(&h, content, sizeof(h));
+	return (size_t)((((size * FNV_PRIME) ^ h) * FNV_PRIME) ^ options) & (index_size - 1);
+}
+
+
+static void index_record(size_t n)
+{
+	const struct cache_record *r = &records[n];
+	size_t i;
+
+	/* Replace older record of the same file, or add to the first free slot */
+	i = stat_slot(r->dev, r->ino, r->options);
+	while (stat_index[i]) {
+		const struct cache_record *o = &records[stat_index[i] - 1];
+		if (o->dev == r->dev && o->ino == r->ino && o->options == r->options) {
+			superseded++;
+			break;
+		}
+		i = (i + 1) & (index_size - 1);
+	}
+	stat_index[i] = n + 1;
+
+	i = content_slot(r->size, r->content, r->options);
+	while (content_index[i]) {
+		const struct cache_record *o = &records[content_index[i] - 1];
+		if (o->size == r->size && o->options == r->options &&
+			!memcmp(o->content, r->content, SHA256_SIZE))
+			break;
+		i = (i + 1) & (index_size - 1);
+	}
+	content_index[i] = n + 1;
+}
+
+
+static void add_record(const struct cache_record *r)
+{
+	if (record_count >= record_size) {
+		void *p;
+
+		record_size = (record_size > 0 ? record_size * 2 : 512);
+		if (!(p = realloc(records, record_size * sizeof(struct cache_record))))
+			fatal("not enough memory");
+		records = p;
+	}
+	if (record_count * 2 >= index_size) {
+		/* Grow the hash tables, and rebuild index... */
+		free(stat_index);
+		free(content_index);
+		index_size = (index_size > 0 ? index_size * 2 : 1024);
+		stat_index = calloc(index_size, sizeof(size_t));
+		content_index = calloc(index_size, sizeof(size_t));
+		if (!stat_index || !content_index)
+			fatal("not enough memory");
+		superseded = 0;
+		for (size_t i = 0; i < record_count; i++)
+			index_record(i);
+	}
+	records[record_count] = *r;
+	index_record(record_count++);
+}
+
+
+static void compact_cache(const char *filename)
+{
+	char tmpname[MAXPATHLEN + 1];
+	unsigned char *live;
+	size_t count = 0;
+	int n, fd, err = 0;
+
+	/* Rewrite cache file with only the latest record of each file (for any options) */
+	n = snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+	if (n < 0 || (size_t)n >= sizeof(tmpname))
+		return;
+	if (!(live = calloc(record_count, 1)))
+		fatal("not enough memory");
+	for (size_t i = 0; i < index_size; i++) {
+		if (stat_index[i])
+			live[stat_index[i] - 1] = 1;
+	}
+	if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+				S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+		free(live);
+		return;
+	}
+	for (size_t i = 0; i < record_count; i++) {
+		if (!live[i])
+			continue;
+		if (!err && writen(fd, &records[i], sizeof(records[i])) != sizeof(records[i]))
+			err = 1;
+		records[count++] = records[i];
+	}
+	free(live);
+	if (fsync(fd) != 0)
+		err = 1;
+	if (close(fd) != 0)
+		err = 1;
+	if (err || rename_file(tmpname, filename)) {
+		warn("failed to compact cache file: %s", filename);
+		delete_file(tmpname);
+	}
+
+	/* Rebuild index of the remaining records */
+	record_count = count;
+	memset(stat_index, 0, index_size * sizeof(size_t));
+	memset(content_index, 0, index_size * sizeof(size_t));
+	superseded = 0;
+	for (size_t i = 0; i < record_count; i++)
+		index_record(i);
+}
+
+
+int cache_open(const char *filename, uint64_t options)
+{
+	struct cache_record r;
+	FILE *fp;
+
+	cache_options = options;
+
+	/* Load existing records (from runs with any options)... */
+	if ((fp = fopen(filename, "rb"))) {
+		while (fread(&r, sizeof(r), 1, fp) == 1) {
+			if (r.magic != CACHE_MAGIC || r.check != record_check(&r))
+				continue;
+			add_record(&r);
+		}
+		fclose(fp);
+	}
+	if (superseded > record_count - superseded)
+		compact_cache(filename);
+
+	/* ...and open file for appending new records */
+	if ((cache_fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+					S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)
+		return -1;
+
+	return 0;
+}
+
+
+int cache_lookup(const struct stat *st)
+{
+	size_t i;
+
+	if (cache_fd < 0 || index_size < 1)
+		return 0;
+
+	/* Same file (and not modified) since the last run? */
+	i = stat_slot(st->st_dev, st->st_ino, cache_options);
+	while (stat_index[i]) {
+		const struct cache_record *o = &records[stat_index[i] - 1];
+		if (o->dev == (uint64_t)st->st_dev && o->ino == (uint64_t)st->st_ino &&
+			o->options == cache_options) {
+			if (o->size == (uint64_t)st->st_size && o->mtime == file_mtime(st))
+				return o->result;
+			break;
+		}
+		i = (i + 1) & (index_size - 1);
+	}
+
+	return 0;
+}
+
+
+int cache_lookup_content(const struct stat *st, const unsigned char *digest)
+{
+	size_t i;
+
+	if (cache_fd < 0 || index_size < 1)
+		return 0;
+
+	/* Have we seen a file with same size and contents (digest)?
+	   (this is called by workers, after they have read the file) */
+	i = content_slot(st->st_size, digest, cache_options);
+	while (content_index[i]) {
+		const struct cache_record *o = &records[content_index[i] - 1];
+		if (o->size == (uint64_t)st->st_size && o->options == cache_options &&
+			!memcmp(o->content, digest, SHA256_SIZE)) {
+			/* Remember this file too */
+			cache_store(st, digest, o->result);
+			return o->result;
+		}
+		i = (i + 1) & (index_size - 1);
+	}
+
+	return 0;
+}
+
+
+void cache_store(const struct stat *st, const unsigned char *digest, int result)
+{
+	struct cache_record r;
+
+	if (cache_fd < 0)
+		return;
+
+	memset(&r, 0, sizeof(r));
+	r.magic = CACHE_MAGIC;
+	r.dev = st->st_dev;
+	r.ino = st->st_ino;
+	r.size = st->st_size;
+	r.mtime = file_mtime(st);
+	r.options = cache_options;
+	memcpy(r.content, digest, SHA256_SIZE);
+	r.result = result;
+	r.check = record_check(&r);
+
+	/* Single (append) write, so records from different workers do not get mixed */
+	if (write(cache_fd, &r, sizeof(r)) != (ssize_t)sizeof(r))
+		warn("failed to update cache file");
+}
+
+
+void cache_close(void)
+{
+	if (cache_fd >= 0)
+		close(cache_fd);
+	cache_fd = -1;
+	free(records);
+	free(stat_index);
+	free(content_index);
+	records = NULL;
+	stat_index = content_index = NULL;
+	record_count = record_size = index_size = superseded = 0;
+}
+
+
+/* eof :-) */
@@ -0,0 +1,225 @@
+/* dedup.c
+ *
+ * Copyright (C) 2025 Timo Kokkonen
+ * All Rights Reserved.
+ *
+ * Reuse results for identical input files (--dedup), using a table in
+ * shared memory, so that it is visible to all workers (threads and processes).
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of JPEGoptim.
+ *
+ * JPEGoptim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JPEGoptim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JPEGoptim. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "jpegoptim.h"
+
+#ifdef DEDUP_SUPPORT
+#include <sys/mman.h>
+#include <pthread.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define DEDUP_BYTES_PER_SLOT (32 * 1024)	/* (expected) input and output data per table entry */
+
+
+/* Entry is matched by comparing full contents of the input file (hash is
+   only used to find it), and it is published by setting hash last */
+struct dedup_entry {
+	uint64_t hash;		/* hash of the input file */
+	uint64_t insize;
+	size_t   inoffset;	/* location of input data */
+	size_t   offset;	/* location of output data (0 = not stored) */
+	struct dedup_info info;
+};
+
+struct dedup_table {
+	pthread_mutex_t lock;
+	size_t size;		/* size of the shared memory area */
+	size_t used;		/* end of used data area */
+	size_t slots;		/* size of the hash table (power of two) */
+	size_t count;		/* number of entries in the table */
+	struct dedup_entry entry[];
+};
+
+
+static struct dedup_table *table = NULL;
+
+
+
+int dedup_init(size_t size)
+{
+	pthread_mutexattr_t attr;
+	size_t slots = 1024;
+	void *p;
+
+	while (slots * 2 * DEDUP_BYTES_PER_SLOT <= size)
+		slots *= 2;
+	if (size < sizeof(struct dedup_table) + slots * sizeof(struct dedup_entry))
+		return -1;
+
+	/* Anonymous shared mapping is inherited by forked workers
+	   (and pages get allocated only when they are used) */
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	table = p;
+	table->size = size;
+	table->slots = slots;
+	table->count = 0;
+	table->used = sizeof(struct dedup_table) + slots * sizeof(struct dedup_entry);
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+	/* Worker process could die while holding the lock */
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+	pthread_mutex_init(&table->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	return 0;
+}
+
+
+static int lock_table(void)
+{
+	int r = pthread_mutex_lock(&table->lock);
+
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+	if (r == EOWNERDEAD) {
+		/* Previous owner died, but table is still consistent
+		   (partially added entry was never published) */
+		pthread_mutex_consistent(&table->lock);
+		r = 0;
+	}
+#endif
+
+	return r;
+}
+
+
+static struct dedup_entry* find_entry(uint64_t hash, const void *in, size_t insize)
+{
+	size_t i = hash & (table->slots - 1);
+
+	/* Returns matching entry, or the (empty) slot where it should go */
+	while (table->entry[i].hash != 0) {
+		const struct dedup_entry *e = &table->entry[i];
+
+		if (e->hash == hash && e->insize == insize &&
+			!memcmp((unsigned char*)table + e->inoffset, in, insize))
+			break;
+		i = (i + 1) & (table->slots - 1);
+	}
+
+	return &table->entry[i];
+}
+
+
+int dedup_lookup(uint64_t hash, const void *in, size_t insize, struct dedup_info *info,
+		struct seg_buffer *out)
+{
+	struct dedup_entry *e;
+	int found = 0;
+
+	if (!table || hash == 0)
+		return 0;
+
+	if (lock_table() != 0)
+		return 0;
+	e = find_entry(hash, in, insize);
+	if (e->hash != 0) {
+		*info = e->info;
+		seg_buffer_load(out, (e->offset ? (unsigned char*)table + e->offset : NULL),
+				(e->offset ? e->info.outlen : 0));
+		found = 1;
+	}
+	pthread_mutex_unlock(&table->lock);
+
+	return found;
+}
+
+
+void dedup_store(uint64_t hash, const void *in, size_t insize,
+		const struct dedup_info *info, const struct seg_buffer *out)
+{
+	struct dedup_entry *e;
+	size_t need;
+	unsigned char *p;
+
+	if (!table || hash == 0)
+		return;
+
+	if (lock_table() != 0)
+		return;
+	/* Keep table at most half full */
+	if (table->count * 2 >= table->slots)
+		goto done;
+	e = find_entry(hash, in, insize);
+	if (e->hash != 0)
+		goto done;	/* another worker was faster */
+	need = ((insize + 15) & ~(size_t)15) + (out ? out->used : 0);
+	if (table->size - table->used < need)
+		goto done;	/* no space for the input (and output) data */
+
+	e->insize = insize;
+	e->info = *info;
+	e->inoffset = table->used;
+	memcpy((unsigned char*)table + table->used, in, insize);
+	table->used += (insize + 15) & ~(size_t)15;
+	e->offset = 0;
+	if (out) {
+		e->offset = table->used;
+		e->info.outlen = out->used;
+		p = (unsigned char*)table + table->used;
+		for (size_t i = 0; i * SEG_SIZE < out->used; i++) {
+			size_t len = (out->used - i * SEG_SIZE < SEG_SIZE ?
+				out->used - i * SEG_SIZE : SEG_SIZE);
+			memcpy(p + i * SEG_SIZE, out->seg[i], len);
+		}
+		/* keep entries aligned */
+		table->used += (out->used + 15) & ~(size_t)15;
+	}
+	e->hash = hash;
+	table->count++;
+ done:
+	pthread_mutex_unlock(&table->lock);
+}
+
+
+void dedup_exit(void)
+{
+	if (!table)
+		return;
+	pthread_mutex_destroy(&table->lock);
+	munmap(table, table->size);
+	table = NULL;
+}
+
+#endif /* DEDUP_SUPPORT */
+
+
+/* eof :-) */
@@ -0,0 +1,269 @@
+/* filelist.c
+ *
+ * Copyright (C) 2025 Timo Kokkonen
+ * All Rights Reserved.
+ *
+ * List of input files to process (from command line or from a file),
+ * optionally sorted to schedule files in specific order.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of JPEGoptim.
+ *
+ * JPEGoptim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JPEGoptim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JPEGoptim. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jpegoptim.h"
+
+
+const char *file_order_names[] = {
+	"input",
+	"largest",
+	"smallest",
+	"newest",
+	NULL
+};
+
+
+static struct file_entry *list = NULL;
+static size_t list_count = 0;
+static size_t list_size = 0;
+static size_t list_next = 0;
+static int list_order = ORDER_INPUT;
+
+static int l_argc = 0;
+static char **l_argv = NULL;
+static int l_idx = 0;
+static FILE *l_from = NULL;
+static long l_seq = 0;
+
+static struct file_entry current;
+static int current_alloc = 0;	/* current.name was allocated */
+static char namebuf[MAXPATHLEN + 2];
+
+/* Files read ahead of the current one (for peek_file()) */
+static struct file_entry ahead[LOOKAHEAD_MAX];
+static int ahead_first = 0;
+static int ahead_count = 0;
+
+
+
+int parse_file_order(const char *s)
+{
+	for (int i = 0; file_order_names[i]; i++) {
+		if (!strcmp(s, file_order_names[i]))
+			return i;
+	}
+
+	return -1;
+}
+
+
+static const char* read_name(void)
+{
+	if (l_from) {
+		if (!fgetstr(namebuf, sizeof(namebuf), l_from))
+			return NULL;
+		return namebuf;
+	}
+
+	if (l_idx >= l_argc)
+		return NULL;
+
+	return l_argv[l_idx++];
+}
+
+
+static void stat_entry(struct file_entry *e)
+{
+	e->regular = 0;
+	if (*e->name == 0 || strnlen(e->name, MAXPATHLEN + 1) > MAXPATHLEN)
+		return;
+	if (is_file(e->name, &e->st))
+		e->regular = 1;
+}
+
+
+static long long entry_mtime(const struct file_entry *e)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	return (long long)e->st.st_mtim.tv_sec * 1000000000LL + e->st.st_mtim.tv_nsec;
+#else
+	return (long long)e->st.st_mtime;
+#endif
+}
+
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct file_entry *e1 = (const struct file_entry*)a;
+	const struct file_entry *e2 = (const struct file_entry*)b;
+	long long v1 = 0, v2 = 0;
+
+	switch (list_order) {
+	case ORDER_LARGEST:
+		v1 = e2->st.st_size;
+		v2 = e1->st.st_size;
+		break;
+	case ORDER_SMALLEST:
+		v1 = e1->st.st_size;
+		v2 = e2->st.st_size;
+		break;
+	case ORDER_NEWEST:
+		v1 = entry_mtime(e2);
+		v2 = entry_mtime(e1);
+		break;
+	}
+
+	if (v1 != v2)
+		return (v1 < v2 ? -1 : 1);
+
+	/* Keep input order for otherwise equal entries */
+	return (e1->seq < e2->seq ? -1 : (e1->seq > e2->seq ? 1 : 0));
+}
+
+
+void init_file_list(int argc, char **argv, int arg_idx, FILE *files_from, int order)
+{
+	const char *name;
+	struct file_entry *e;
+
+	l_argc = argc;
+	l_argv = argv;
+	l_idx = arg_idx;
+	l_from = files_from;
+	list_order = order;
+
+	if (order == ORDER_INPUT)
+		return;
+
+	/* Read (and stat) all the files first, to be able to sort them... */
+	while ((name = read_name())) {
+		if (list_count >= list_size) {
+			size_t newsize = (list_size > 0 ? list_size * 2 : 1024);
+
+			if (!(e = realloc(list, newsize * sizeof(struct file_entry))))
+				fatal("not enough memory");
+			list = e;
+			list_size = newsize;
+		}
+		e = &list[list_count];
+		memset(e, 0, sizeof(*e));
+		if (!(e->name = strdup(name)))
+			fatal("not enough memory");
+		e->seq = l_seq++;
+		stat_entry(e);
+		list_count++;
+	}
+
+	qsort(list, list_count, sizeof(struct file_entry), compare_entries);
+}
+
+
+static int read_entry(struct file_entry *e)
+{
+	const char *name;
+
+	if (!(name = read_name()))
+		return 0;
+	memset(e, 0, sizeof(*e));
+	if (!(e->name = strdup(name)))
+		fatal("not enough memory");
+	e->seq = l_seq++;
+	stat_entry(e);
+
+	return 1;
+}
+
+
+struct file_entry* next_file(void)
+{
+	if (list_order != ORDER_INPUT) {
+		if (list_next >= list_count)
+			return NULL;
+		return &list[list_next++];
+	}
+
+	if (current_alloc) {
+		free(current.name);
+		current_alloc = 0;
+	}
+
+	if (ahead_count > 0) {
+		/* Take next file from the files already read ahead */
+		current = ahead[ahead_first];
+		ahead_first = (ahead_first + 1) % LOOKAHEAD_MAX;
+		ahead_count--;
+		current_alloc = 1;
+		return &current;
+	}
+
+	/* Name must be copied, as read_name() buffer is reused when reading ahead */
+	if (!read_entry(&current))
+		return NULL;
+	current_alloc = 1;
+
+	return &current;
+}
+
+
+struct file_entry* peek_file(int n)
+{
+	/* Return n:th file after the one last returned by next_file() (without consuming it) */
+	if (n < 0 || n >= LOOKAHEAD_MAX)
+		return NULL;
+
+	if (list_order != ORDER_INPUT) {
+		if (list_next + n >= list_count)
+			return NULL;
+		return &list[list_next + n];
+	}
+
+	while (ahead_count <= n) {
+		if (!read_entry(&ahead[(ahead_first + ahead_count) % LOOKAHEAD_MAX]))
+			return NULL;
+		ahead_count++;
+	}
+
+	return &ahead[(ahead_first + n) % LOOKAHEAD_MAX];
+}
+
+
+void free_file_list(void)
+{
+	for (size_t i = 0; i < list_count; i++)
+		free(list[i].name);
+	free(list);
+	list = NULL;
+	list_count = list_size = list_next = 0;
+
+	while (ahead_count > 0) {
+		free(ahead[ahead_first].name);
+		ahead_first = (ahead_first + 1) % LOOKAHEAD_MAX;
+		ahead_count--;
+	}
+	if (current_alloc)
+		free(current.name);
+	current_alloc = 0;
+}
+
+
+/* eof :-) */
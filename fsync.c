@@ -0,0 +1,287 @@
+/* fsync.c
+ *
+ * Copyright (C) 2025 Timo Kokkonen
+ * All Rights Reserved.
+ *
+ * Durability of output files (--fsync): per file, or batched per directory.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of JPEGoptim.
+ *
+ * JPEGoptim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JPEGoptim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JPEGoptim. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#include "jpegoptim.h"
+
+#ifdef WORKER_THREADS
+#include <pthread.h>
+#endif
+
+#define SYNC_GROUPS 16		/* max number of directories with pending files */
+
+
+/* Files committed to a directory, but not yet synced (--fsync=batch) */
+struct sync_group {
+	char   dir[MAXPATHLEN + 1];
+	int    dirfd;
+	dev_t  dev;
+	int    count;
+	double start;		/* time first file was added */
+};
+
+
+const char *fsync_mode_names[] = {
+	"none",
+	"file",
+	"batch",
+	NULL
+};
+
+static struct sync_group groups[SYNC_GROUPS];
+static int group_count = 0;
+#ifdef WORKER_THREADS
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+
+int parse_fsync_mode(const char *s, int *batch_files, int *batch_time)
+{
+	char mode[16];
+	const char *p;
+	int m = -1;
+
+	/* Parse: <mode>[:<files>[:<msec>]] */
+	if (!(p = strchr(s, ':')))
+		p = s + strlen(s);
+	if ((size_t)(p - s) >= sizeof(mode))
+		return -1;
+	memcpy(mode, s, p - s);
+	mode[p - s] = 0;
+
+	for (int i = 0; fsync_mode_names[i]; i++) {
+		if (!strcmp(mode, fsync_mode_names[i]))
+			m = i;
+	}
+	if (m < 0 || (*p && m != FSYNC_BATCH))
+		return -1;
+
+	if (*p) {
+		int files, msec = *batch_time;
+		int n = sscanf(p + 1, "%d:%d", &files, &msec);
+
+		if (n < 1 || files < 1 || msec < 0)
+			return -1;
+		*batch_files = files;
+		*batch_time = msec;
+	}
+
+	return m;
+}
+
+
+static int sync_dir(int dirfd)
+{
+#ifdef HAVE_SYNCFS
+	/* Flush all files (data and metadata) on the filesystem */
+	return syncfs(dirfd);
+#else
+	sync();
+	return 0;
+#endif
+}
+
+
+static void flush_group(struct sync_group *g)
+{
+	if (g->count > 0 && sync_dir(g->dirfd) != 0)
+		warn("failed to sync directory: %s", g->dir);
+
+	/* ...that also flushed other directories on the same filesystem */
+	for (int i = 0; i < group_count; i++) {
+		if (groups[i].dev == g->dev)
+			groups[i].count = 0;
+	}
+}
+
+
+static struct sync_group* get_group(const char *dir)
+{
+	struct sync_group *g = NULL;
+	struct stat st;
+	int fd;
+
+	for (int i = 0; i < group_count; i++) {
+		if (!strcmp(groups[i].dir, dir))
+			return &groups[i];
+	}
+
+	if ((fd = open((*dir ? dir : "."), O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	if (group_count < SYNC_GROUPS) {
+		g = &groups[group_count++];
+	} else {
+		/* Reuse a group without pending files, or make room by syncing the oldest group */
+		g = &groups[0];
+		for (int i = 1; i < SYNC_GROUPS && g->count > 0; i++) {
+			if (groups[i].count < 1 || groups[i].start < g->start)
+				g = &groups[i];
+		}
+		flush_group(g);
+		close(g->dirfd);
+	}
+	strncopy(g->dir, dir, sizeof(g->dir));
+	g->dirfd = fd;
+	g->dev = st.st_dev;
+	g->count = 0;
+
+	return g;
+}
+
+
+double sync_file(int fd)
+{
+	double t;
+
+	/* Flush file contents before it replaces the target (--fsync=file) */
+	if (fsync_mode != FSYNC_FILE)
+		return 0.0;
+	t = get_time();
+	if (fsync(fd) != 0)
+		warn("failed to sync output file");
+
+	return get_time() - t;
+}
+
+
+double sync_commit(FILE *log_fh, const char *newname)
+{
+	char dir[MAXPATHLEN + 1];
+	struct sync_group *g;
+	double t, now;
+	int fd;
+
+	if (fsync_mode == FSYNC_NONE)
+		return 0.0;
+	if (!splitdir(newname, dir, sizeof(dir)))
+		return 0.0;
+	t = get_time();
+
+	if (fsync_mode == FSYNC_FILE) {
+		/* Make the new directory entry (rename) durable */
+		if ((fd = open((*dir ? dir : "."), O_RDONLY)) >= 0) {
+			if (fsync(fd) != 0)
+				warn("failed to sync directory: %s", dir);
+			close(fd);
+		}
+		return get_time() - t;
+	}
+
+	/* Batch mode, sync filesystem once per N files or T milliseconds... */
+#ifdef WORKER_THREADS
+	pthread_mutex_lock(&sync_lock);
+#endif
+	if ((g = get_group(dir))) {
+		if (g->count++ < 1)
+			g->start = t;
+	} else {
+		warn("cannot open directory: %s", dir);
+	}
+	now = get_time();
+	for (int i = 0; i < group_count; i++) {
+		g = &groups[i];
+		if (g->count > 0 && (g->count >= fsync_batch_files ||
+					(now - g->start) * 1000.0 >= fsync_batch_time)) {
+			if (verbose_mode > 1)
+				fprintf(log_fh, "syncing %d files: %s\n", g->count,
+					(*g->dir ? g->dir : "."));
+			flush_group(g);
+		}
+	}
+#ifdef WORKER_THREADS
+	pthread_mutex_unlock(&sync_lock);
+#endif
+
+	return get_time() - t;
+}
+
+
+void sync_register(const char *newname)
+{
+	char dir[MAXPATHLEN + 1];
+	struct sync_group *g;
+
+	/* Remember output file (possibly written by a worker process), so that
+	   it gets synced by the next sync_flush() call (--journal) */
+	if (fsync_mode == FSYNC_FILE || !splitdir(newname, dir, sizeof(dir)))
+		return;
+#ifdef WORKER_THREADS
+	pthread_mutex_lock(&sync_lock);
+#endif
+	if ((g = get_group(dir))) {
+		if (g->count++ < 1)
+			g->start = get_time();
+	} else {
+		warn("cannot open directory: %s", dir);
+	}
+#ifdef WORKER_THREADS
+	pthread_mutex_unlock(&sync_lock);
+#endif
+}
+
+
+double sync_flush(void)
+{
+	double t = get_time();
+
+	/* Sync all pending files (at exit) */
+#ifdef WORKER_THREADS
+	pthread_mutex_lock(&sync_lock);
+#endif
+	for (int i = 0; i < group_count; i++) {
+		flush_group(&groups[i]);
+		close(groups[i].dirfd);
+	}
+	group_count = 0;
+#ifdef WORKER_THREADS
+	pthread_mutex_unlock(&sync_lock);
+#endif
+
+	return get_time() - t;
+}
+
+
+/* eof :-) */
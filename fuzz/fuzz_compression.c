@@ -32,8 +32,7 @@ int LLVMFuzzerTestOneInput(const uint8_t *data, const size_t size)
     fuzz_manager.new_fuzz_file_name,
     fuzz_manager.tmp_dir,
     &file_stat,
-    &fuzz_manager.rate,
-    &fuzz_manager.saved
+    &fuzz_manager.result
   );
 
   rc = 0;
@@ -3,6 +3,7 @@
 #include <linux/limits.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include "jpegoptim.h"
 
 /**
  * Manages necessary state across fuzz iterations, should exist as singleton
@@ -10,7 +11,7 @@
 typedef struct fuzz_manager
 {
   bool is_init;
-  double rate, saved;
+  struct job_result result;
   FILE *log_fh;
   char fuzz_file_name[PATH_MAX + 1];
   char new_fuzz_file_name[PATH_MAX + 1];
@@ -0,0 +1,283 @@
+/* journal.c
+ *
+ * Copyright (C) 2025 Timo Kokkonen
+ * All Rights Reserved.
+ *
+ * Journal of completed files (--journal), so that an interrupted run can
+ * be continued (--resume) without processing the same files again.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of JPEGoptim.
+ *
+ * JPEGoptim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JPEGoptim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JPEGoptim. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "jpegoptim.h"
+
+#define JOURNAL_HEADER "# jpegoptim journal %016llx\n"
+
+
+/*
+ * Journal is a text file with one line per completed file ("<status> <path>"),
+ * that is only appended to. A partial line (left by a crash) is ignored.
+ *
+ * Entries are written in batches, only after output files of the batch have
+ * been synced to disk, so that journal never lists a file whose output could
+ * still be lost in a crash.
+ *
+ * Journal is removed once all files have been processed successfully.
+ */
+
+static FILE *journal_fp = NULL;
+static char *journal_name = NULL;
+static char **done_table = NULL;	/* hash table of completed files */
+static size_t done_size = 0;
+static size_t done_count = 0;
+static char *pending_buf = NULL;	/* entries not yet written */
+static size_t pending_len = 0;
+static size_t pending_size = 0;
+static int pending = 0;
+static double pending_start = 0.0;
+
+
+
+static char **find_slot(char **table, size_t size, const char *path)
+{
+	size_t i = (size_t)content_hash(0, path, strlen(path)) & (size - 1);
+
+	while (table[i] && strcmp(table[i], path))
+		i = (i + 1) & (size - 1);
+
+	return &table[i];
+}
+
+
+static void add_done(const char *path)
+{
+	char **slot;
+
+	if (done_count * 2 >= done_size) {
+		/* Grow hash table (keep it at most half full)... */
+		size_t newsize = (done_size > 0 ? done_size * 2 : 4096);
+		char **table;
+
+		if (!(table = calloc(newsize, sizeof(char*))))
+			fatal("not enough memory");
+		for (size_t i = 0; i < done_size; i++) {
+			if (done_table[i])
+				*find_slot(table, newsize, done_table[i]) = done_table[i];
+		}
+		free(done_table);
+		done_table = table;
+		done_size = newsize;
+	}
+
+	slot = find_slot(done_table, done_size, path);
+	if (*slot)
+		return;
+	if (!(*slot = strdup(path)))
+		fatal("not enough memory");
+	done_count++;
+}
+
+
+static int load_journal(const char *filename, uint64_t options)
+{
+	char line[MAXPATHLEN + 64];
+	unsigned long long hash;
+	FILE *fp;
+	int count = 0;
+
+	if (!(fp = fopen(filename, "r")))
+		return 0;
+	if (!fgets(line, sizeof(line), fp) || line[strlen(line) - 1] != '\n') {
+		/* Empty file, or partial header (crash before it was written) */
+		fclose(fp);
+		return -2;
+	}
+	if (sscanf(line, JOURNAL_HEADER, &hash) != 1) {
+		fclose(fp);
+		return -4;
+	}
+	if (hash != options) {
+		fclose(fp);
+		return -3;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		size_t len = strlen(line);
+		int status, n;
+
+		if (len < 1 || line[len - 1] != '\n')
+			continue;	/* incomplete entry */
+		line[len - 1] = 0;
+		if (sscanf(line, "%d %n", &status, &n) < 1 || line[n] == 0)
+			continue;
+		/* Files that failed are retried */
+		if (status == 0) {
+			add_done(line + n);
+			count++;
+		}
+	}
+	fclose(fp);
+
+	return count;
+}
+
+
+int journal_open(const char *filename, uint64_t options, int resume)
+{
+	struct stat st;
+	int count = 0;
+
+	if (resume) {
+		/* Never discard a journal that has entries, but cannot be resumed from */
+		if ((count = load_journal(filename, options)) == -2) {
+			/* ...but no entries were ever written to an incomplete one */
+			warn("ignoring empty journal: %s", filename);
+			count = 0;
+			resume = 0;
+		} else if (count < 0) {
+			return count;
+		}
+	} else if (stat(filename, &st) == 0 && st.st_size > 0) {
+		/* Do not silently discard journal of an interrupted run */
+		return -2;
+	}
+
+	/* Continue existing journal, or start a new one */
+	if (!(journal_fp = fopen(filename, (resume ? "a+" : "w"))))
+		return -1;
+	if (!(journal_name = strdup(filename)))
+		fatal("not enough memory");
+	if (fseek(journal_fp, 0, SEEK_END) == 0 && ftell(journal_fp) == 0) {
+		fprintf(journal_fp, JOURNAL_HEADER, (unsigned long long)options);
+	} else if (fseek(journal_fp, -1, SEEK_END) == 0 && fgetc(journal_fp) != '\n') {
+		/* Terminate partial entry, so that it does not get mixed with new ones */
+		fseek(journal_fp, 0, SEEK_END);
+		fputc('\n', journal_fp);
+	}
+	fflush(journal_fp);
+
+	return count;
+}
+
+
+int journal_lookup(const char *path)
+{
+	if (done_count < 1)
+		return 0;
+
+	return (*find_slot(done_table, done_size, path) ? 1 : 0);
+}
+
+
+static double journal_sync(void)
+{
+	double t;
+
+	if (pending < 1)
+		return 0.0;
+
+	/* Sync output files first, and only then add them to the journal */
+	t = sync_flush();
+	if (fwrite(pending_buf, 1, pending_len, journal_fp) != pending_len ||
+		fflush(journal_fp) != 0)
+		warn("failed to write journal file");
+	else if (fsync(fileno(journal_fp)) != 0)
+		warn("failed to sync journal file");
+	pending = 0;
+	pending_len = 0;
+
+	return t;
+}
+
+
+double journal_add(const char *path, const char *newname, int status)
+{
+	size_t len;
+	double now;
+
+	if (!journal_fp || strchr(path, '\n'))
+		return 0.0;
+
+	/* Collect entries, and write them once per N entries or T milliseconds
+	   (--fsync=batch), after syncing the output files */
+	len = strlen(path) + 16;
+	if (pending_len + len > pending_size) {
+		size_t newsize = (pending_size > 0 ? pending_size * 2 : 64 * 1024);
+		void *p;
+
+		while (newsize < pending_len + len)
+			newsize *= 2;
+		if (!(p = realloc(pending_buf, newsize)))
+			fatal("not enough memory");
+		pending_buf = p;
+		pending_size = newsize;
+	}
+	pending_len += snprintf(pending_buf + pending_len, len, "%d %s\n", status, path);
+	if (newname)
+		sync_register(newname);
+
+	now = get_time();
+	if (pending++ < 1)
+		pending_start = now;
+	if (pending >= fsync_batch_files ||
+		(now - pending_start) * 1000.0 >= fsync_batch_time)
+		return journal_sync();
+
+	return 0.0;
+}
+
+
+double journal_close(int complete)
+{
+	double t = 0.0;
+
+	if (journal_fp) {
+		t = journal_sync();
+		fclose(journal_fp);
+		journal_fp = NULL;
+		/* Journal is not needed anymore, if all files were processed successfully */
+		if (complete && unlink(journal_name) != 0)
+			warn("failed to remove journal file: %s", journal_name);
+	}
+	free(journal_name);
+	journal_name = NULL;
+	for (size_t i = 0; i < done_size; i++)
+		free(done_table[i]);
+	free(done_table);
+	free(pending_buf);
+	done_table = NULL;
+	pending_buf = NULL;
+	done_size = done_count = 0;
+	pending_size = 0;
+
+	return t;
+}
+
+
+/* eof :-) */
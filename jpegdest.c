@@ -24,6 +24,9 @@
  * along with JPEGoptim. If not, see <https://www.gnu.org/licenses/>.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +35,13 @@
 
 #include "jpegoptim.h"
 
+#ifdef WORKER_THREADS
+#include <pthread.h>
+#endif
+
+#define SEG_POOL_MAX 256	/* max number of free segments to keep for reuse */
+#define SEG_IOV_MAX  64		/* max number of segments to write at once */
+
 
 
 /* custom jpeg destination manager object */
@@ -129,4 +139,266 @@ void jpeg_memory_dest (j_compress_ptr cinfo, unsigned char **bufptr, size_t *buf
 }
 
 
+
+/* Pool of free segments, to reuse them across trials and files */
+
+static unsigned char *seg_pool[SEG_POOL_MAX];
+static int seg_pool_count = 0;
+#ifdef WORKER_THREADS
+static pthread_mutex_t seg_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+static unsigned char* seg_alloc(void)
+{
+	unsigned char *seg = NULL;
+
+#ifdef WORKER_THREADS
+	pthread_mutex_lock(&seg_pool_lock);
+#endif
+	if (seg_pool_count > 0)
+		seg = seg_pool[--seg_pool_count];
+#ifdef WORKER_THREADS
+	pthread_mutex_unlock(&seg_pool_lock);
+#endif
+
+	/* no need to clear new segments, they are always written before being read */
+	if (!seg && !(seg = malloc(SEG_SIZE)))
+		fatal("not enough memory");
+
+	return seg;
+}
+
+
+static void seg_release(unsigned char *seg)
+{
+#ifdef WORKER_THREADS
+	pthread_mutex_lock(&seg_pool_lock);
+#endif
+	if (seg_pool_count < SEG_POOL_MAX) {
+		seg_pool[seg_pool_count++] = seg;
+		seg = NULL;
+	}
+#ifdef WORKER_THREADS
+	pthread_mutex_unlock(&seg_pool_lock);
+#endif
+	if (seg)
+		free(seg);
+}
+
+
+static void seg_buffer_grow(struct seg_buffer *b)
+{
+	if (b->count >= b->size) {
+		size_t newsize = (b->size > 0 ? b->size * 2 : 64);
+		unsigned char **newseg = realloc(b->seg, newsize * sizeof(unsigned char*));
+
+		if (!newseg)
+			fatal("not enough memory");
+		b->seg = newseg;
+		b->size = newsize;
+	}
+	b->seg[b->count++] = seg_alloc();
+}
+
+
+void seg_buffer_load(struct seg_buffer *b, const void *data, size_t len)
+{
+	/* Replace contents of the buffer (reusing segments already in the buffer) */
+	b->used = 0;
+	while (b->used < len) {
+		size_t i = b->used / SEG_SIZE;
+		size_t n = (len - b->used < SEG_SIZE ? len - b->used : SEG_SIZE);
+
+		if (i >= b->count)
+			seg_buffer_grow(b);
+		memcpy(b->seg[i], (const unsigned char*)data + b->used, n);
+		b->used += n;
+	}
+}
+
+
+void seg_buffer_digest(const struct seg_buffer *b, const void *extra, size_t extralen,
+		unsigned char *digest)
+{
+	struct sha256_ctx ctx;
+
+	/* Digest of the contents of the buffer (same as digest of the file written) */
+	sha256_init(&ctx);
+	for (size_t i = 0; i * SEG_SIZE < b->used; i++)
+		sha256_update(&ctx, b->seg[i], (b->used - i * SEG_SIZE < SEG_SIZE ?
+						b->used - i * SEG_SIZE : SEG_SIZE));
+	if (extralen > 0)
+		sha256_update(&ctx, extra, extralen);
+	sha256_final(&ctx, digest);
+}
+
+
+void seg_buffer_free(struct seg_buffer *b)
+{
+	for (size_t i = 0; i < b->count; i++)
+		seg_release(b->seg[i]);
+	free(b->seg);
+	memset(b, 0, sizeof(*b));
+}
+
+
+void seg_buffer_swap(struct seg_buffer *a, struct seg_buffer *b)
+{
+	struct seg_buffer tmp = *a;
+
+	*a = *b;
+	*b = tmp;
+}
+
+
+size_t seg_buffer_write(int fd, const struct seg_buffer *b, const void *extra, size_t extralen)
+{
+#ifdef HAVE_SYS_UIO_H
+	struct iovec iov[SEG_IOV_MAX + 1];
+	size_t done = 0, len, w;
+	size_t i = 0;
+	int n;
+
+	/* Write contents of the buffer (and extra data) using vectored writes... */
+	do {
+		for (n = 0, len = 0; n < SEG_IOV_MAX && i * SEG_SIZE < b->used; n++, i++) {
+			iov[n].iov_base = b->seg[i];
+			iov[n].iov_len = (b->used - i * SEG_SIZE < SEG_SIZE ?
+					b->used - i * SEG_SIZE : SEG_SIZE);
+			len += iov[n].iov_len;
+		}
+		if (i * SEG_SIZE >= b->used && extralen > 0) {
+			iov[n].iov_base = (void*)extra;
+			iov[n].iov_len = extralen;
+			len += extralen;
+			extralen = 0;
+			n++;
+		}
+		if ((w = writevn(fd, iov, n)) != len)
+			return done + w;
+		done += w;
+	} while (i * SEG_SIZE < b->used);
+
+	return done;
+#else
+	size_t done = 0, len, w;
+
+	/* Write contents of the buffer (and extra data) one segment at a time... */
+	for (size_t i = 0; i * SEG_SIZE < b->used; i++) {
+		len = (b->used - i * SEG_SIZE < SEG_SIZE ? b->used - i * SEG_SIZE : SEG_SIZE);
+		if ((w = writen(fd, b->seg[i], len)) != len)
+			return done + w;
+		done += w;
+	}
+	if (extralen > 0)
+		done += writen(fd, extra, extralen);
+
+	return done;
+#endif
+}
+
+
+#ifdef HAVE_SYS_UIO_H
+int seg_buffer_iov(const struct seg_buffer *b, const void *extra, size_t extralen,
+		struct iovec *iov, int max)
+{
+	int n = 0;
+
+	/* Describe contents of the buffer (and extra data) as iovec array,
+	   returns -1 if it does not fit in max entries */
+	for (size_t i = 0; i * SEG_SIZE < b->used; i++) {
+		if (n >= max)
+			return -1;
+		iov[n].iov_base = b->seg[i];
+		iov[n].iov_len = (b->used - i * SEG_SIZE < SEG_SIZE ?
+				b->used - i * SEG_SIZE : SEG_SIZE);
+		n++;
+	}
+	if (extralen > 0) {
+		if (n >= max)
+			return -1;
+		iov[n].iov_base = (void*)extra;
+		iov[n].iov_len = extralen;
+		n++;
+	}
+
+	return n;
+}
+#endif
+
+
+/* custom jpeg destination manager writing into segmented buffer */
+
+typedef struct {
+	struct jpeg_destination_mgr pub; /* public fields */
+
+	struct seg_buffer *buf;
+	size_t current;		/* segment currently being written */
+} jpeg_segment_destination_mgr;
+
+typedef jpeg_segment_destination_mgr* jpeg_segment_destination_ptr;
+
+
+static void jpeg_segment_init_destination (j_compress_ptr cinfo)
+{
+	jpeg_segment_destination_ptr dest = (jpeg_segment_destination_ptr) cinfo->dest;
+
+	/* (re)use existing segments from the start */
+	dest->current = 0;
+	dest->buf->used = 0;
+	if (dest->buf->count < 1)
+		seg_buffer_grow(dest->buf);
+	dest->pub.next_output_byte = dest->buf->seg[0];
+	dest->pub.free_in_buffer = SEG_SIZE;
+}
+
+
+static boolean jpeg_segment_empty_output_buffer (j_compress_ptr cinfo)
+{
+	jpeg_segment_destination_ptr dest = (jpeg_segment_destination_ptr) cinfo->dest;
+
+	/* current segment is full, move on to next segment */
+	if (++dest->current >= dest->buf->count)
+		seg_buffer_grow(dest->buf);
+	dest->pub.next_output_byte = dest->buf->seg[dest->current];
+	dest->pub.free_in_buffer = SEG_SIZE;
+
+	return TRUE;
+}
+
+
+static void jpeg_segment_term_destination (j_compress_ptr cinfo)
+{
+	jpeg_segment_destination_ptr dest = (jpeg_segment_destination_ptr) cinfo->dest;
+
+	dest->buf->used = dest->current * SEG_SIZE + (SEG_SIZE - dest->pub.free_in_buffer);
+}
+
+
+void jpeg_segment_dest (j_compress_ptr cinfo, struct seg_buffer *buf)
+{
+	jpeg_segment_destination_ptr dest;
+
+	if (!cinfo || !buf)
+		fatal("invalid call to jpeg_segment_dest()");
+
+	/* Allocate destination manager object for compress object, if needed. */
+	if (!cinfo->dest || cinfo->dest->init_destination != jpeg_segment_init_destination) {
+		cinfo->dest = (struct jpeg_destination_mgr *)
+			(*cinfo->mem->alloc_small) ( (j_common_ptr) cinfo,
+						JPOOL_PERMANENT,
+						sizeof(jpeg_segment_destination_mgr) );
+	}
+
+	dest = (jpeg_segment_destination_ptr)cinfo->dest;
+	dest->buf = buf;
+	dest->current = 0;
+
+	dest->pub.init_destination = jpeg_segment_init_destination;
+	dest->pub.empty_output_buffer = jpeg_segment_empty_output_buffer;
+	dest->pub.term_destination = jpeg_segment_term_destination;
+}
+
+
 /* eof :-) */
@@ -151,4 +151,52 @@ const char* jpeg_special_marker_name(jpeg_saved_marker_ptr marker)
 }
 
 
+int jpeg_read_frame_header(FILE *fp, unsigned int *width, unsigned int *height,
+			int *components, int *progressive)
+{
+	int c, marker, len;
+
+	/* Scan markers (without decoding anything) until SOFn is found... */
+	if (getc(fp) != 0xff || getc(fp) != 0xd8)
+		return -1;
+
+	for (;;) {
+		if ((c = getc(fp)) == EOF)
+			return -1;
+		if (c != 0xff)
+			continue;
+		while ((marker = getc(fp)) == 0xff)
+			;
+		if (marker == EOF)
+			return -1;
+		if (marker == 0x00 || marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7))
+			continue;
+		if (marker == 0xd9 || marker == 0xda)
+			return -1;
+
+		len = getc(fp) << 8;
+		len |= getc(fp);
+		if (len < 2)
+			return -1;
+
+		if (marker >= 0xc0 && marker <= 0xcf &&
+			marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+			unsigned char sof[6];
+
+			if (fread(sof, 1, sizeof(sof), fp) != sizeof(sof))
+				return -1;
+			*height = (sof[1] << 8) | sof[2];
+			*width = (sof[3] << 8) | sof[4];
+			*components = sof[5];
+			*progressive = (marker == 0xc2 || marker == 0xc6 ||
+					marker == 0xca || marker == 0xce);
+			return 0;
+		}
+
+		if (fseek(fp, len - 2, SEEK_CUR) != 0)
+			return -1;
+	}
+}
+
+
 /* eof :-) */
@@ -22,6 +22,8 @@ const char* jpeg_marker_name(unsigned int marker);
 const char* jpeg_special_marker_name(jpeg_saved_marker_ptr marker);
 int jpeg_special_marker(jpeg_saved_marker_ptr marker);
 size_t jpeg_special_marker_types_count();
+int jpeg_read_frame_header(FILE *fp, unsigned int *width, unsigned int *height,
+			int *components, int *progressive);
 
 
 #endif /* JPEGMARKER_H */
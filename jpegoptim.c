@@ -54,6 +54,7 @@
 #endif
 #include <signal.h>
 #include <string.h>
+#include <errno.h>
 #include <jpeglib.h>
 #include <jerror.h>
 #include <setjmp.h>
@@ -67,30 +68,34 @@
 #define VERSION "1.5.7beta"
 #define COPYRIGHT  "Copyright (C) 1996-2025, Timo Kokkonen"
 
-#if HAVE_WAIT && HAVE_FORK
-#define PARALLEL_PROCESSING 1
-#define MAX_WORKERS 256
-#endif
-
 #define IN_BUF_SIZE (256 * 1024)
 
 
+/* Per job (file) state, so that optimize() does not modify any globals */
+struct job_context {
+	FILE *log_fh;
+	int  quality;
+	int  auto_mode;
+	int  all_normal;
+	int  all_progressive;
+	int  error_counter;
+	char last_error[JMSG_LENGTH_MAX+1];
+};
+
 struct my_error_mgr {
 	struct jpeg_error_mgr pub;
 	jmp_buf setjmp_buffer;
 	int     jump_set;
+	struct job_context *ctx;
 };
 typedef struct my_error_mgr * my_error_ptr;
 
-
-#ifdef PARALLEL_PROCESSING
-struct worker {
-	pid_t pid;
-	int   read_pipe;
+/* Settings used for an output image (candidate) */
+struct output_params {
+	int quality;
+	int progressive;
+	int arith;
 };
-struct worker *workers;
-int worker_count = 0;
-#endif
 
 
 int verbose_mode = 0;
@@ -126,33 +131,84 @@ int target_size = 0;
 int arith_mode = -1;
 #endif
 int max_workers = 1;
+int thread_mode = 0;
 int nofix_mode = 0;
 int files_stdin = 0;
 FILE *files_from = NULL;
+int file_order = ORDER_INPUT;
+long long max_memory = 0;
+int ordered_output = 0;
+int adaptive_mode = 0;
+int pin_mode = 0;
+char *pin_cpus = NULL;
+int read_mode = READ_MMAP;
+int io_uring_mode = 0;
+int prefetch_depth = -1;
+int nocache_mode = 0;
+char *cache_file = NULL;
+char *manifest_file = NULL;
+char *journal_file = NULL;
+int resume_mode = 0;
+int stamp_mode = 0;
+int skip_stamped = 0;
+uint64_t settings_hash = 0;
+int stamp_warned = 0;
+#ifdef DEDUP_SUPPORT
+int dedup_mode = 0;
+long long dedup_size = DEDUP_SIZE;
+#endif
+long long nocache_direct = 0;
+int copy_skipped = 0;
+int fsync_mode = FSYNC_NONE;
+int fsync_batch_files = 100;
+int fsync_batch_time = 1000;
 
 int compress_err_count = 0;
 int decompress_err_count = 0;
-int global_error_counter = 0;
-char last_error[JMSG_LENGTH_MAX+1];
-FILE *jpeg_log_fh;
+int worker_err_count = 0;
 long average_count = 0;
+long cached_count = 0;
+long stamped_count = 0;
+long unchanged_count = 0;
+long resumed_count = 0;
 double average_rate = 0.0;
 double total_save = 0.0;
+struct job_result totals;
+
+const char *read_mode_names[] = {
+	"mmap",
+	"stream",
+	"read",
+	NULL
+};
 
 const struct option long_options[] = {
 #ifdef HAVE_ARITH_CODE
 	{ "all-arith",          0, &arith_mode,          1 },
 	{ "all-huffman",        0, &arith_mode,          0 },
+#endif
+#ifdef PARALLEL_PROCESSING
+	{ "adaptive",           0, &adaptive_mode,       1 },
 #endif
 	{ "auto-mode",          0, &auto_mode,          1 },
+	{ "cache",              1, 0,                    'c' },
 	{ "all-normal",         0, &all_normal,          1 },
 	{ "all-progressive",    0, &all_progressive,     1 },
+	{ "copy-skipped",       0, &copy_skipped,        1 },
 	{ "csv",                0, 0,                    'b' },
+#ifdef DEDUP_SUPPORT
+	{ "dedup",              2, 0,                    'D' },
+#endif
 	{ "dest",               1, 0,                    'd' },
 	{ "files-stdin",        0, &files_stdin,         1 },
 	{ "files-from",         1, 0,                    'F' },
 	{ "force",              0, 0,                    'f' },
+	{ "fsync",              1, 0,                    'Y' },
 	{ "help",               0, 0,                    'h' },
+#ifdef HAVE_IO_URING
+	{ "io-uring",           0, &io_uring_mode,       1 },
+#endif
+	{ "journal",            1, 0,                    'J' },
 	{ "keep-adobe",         0, &save_adobe,          1 },
 	{ "keep-all",           0, &strip_none,          1 },
 	{ "keep-com",           0, &save_com,            1 },
@@ -162,16 +218,33 @@ const struct option long_options[] = {
 	{ "keep-jfif",          0, &save_jfif,           1 },
 	{ "keep-jfxx",          0, &save_jfxx,           1 },
 	{ "keep-xmp",           0, &save_xmp,            1 },
+	{ "manifest",           1, 0,                    'N' },
 	{ "max",                1, 0,                    'm' },
+#ifdef PARALLEL_PROCESSING
+	{ "max-memory",         1, 0,                    'M' },
+#endif
 	{ "noaction",           0, 0,                    'n' },
+	{ "no-cache",           2, 0,                    'C' },
 	{ "nofix",              0, &nofix_mode,          1 },
+	{ "order",              1, 0,                    'O' },
+#ifdef PARALLEL_PROCESSING
+	{ "ordered",            0, &ordered_output,      1 },
+#endif
 	{ "overwrite",          0, 0,                    'o' },
+#ifdef PARALLEL_PROCESSING
+	{ "pin",                2, 0,                    'A' },
+#endif
+	{ "prefetch",           1, 0,                    'H' },
 	{ "preserve",           0, 0,                    'p' },
 	{ "preserve-perms",     0, 0,                    'P' },
 	{ "quiet",              0, 0,                    'q' },
+	{ "read-mode",          1, 0,                    'R' },
+	{ "resume",             0, &resume_mode,         1 },
 	{ "retry",              0, &retry_mode,          'r' },
 	{ "save-extra",         0, &save_extra,          1 },
 	{ "size",               1, 0,                    'S' },
+	{ "skip-stamped",       0, &skip_stamped,        1 },
+	{ "stamp",              0, &stamp_mode,          1 },
 	{ "stdin",              0, &stdin_mode,          1 },
 	{ "stdout",             0, &stdout_mode,         1 },
 	{ "strip-all",          0, 0,                    's' },
@@ -188,8 +261,11 @@ const struct option long_options[] = {
 	{ "totals",             0, 0,                    't' },
 	{ "verbose",            0, 0,                    'v' },
 	{ "version",            0, 0,                    'V' },
+#ifdef WORKER_THREADS
+	{ "threads",            0, &thread_mode,         1 },
+#endif
 #ifdef PARALLEL_PROCESSING
-	{ "workers",            1, &max_workers,         'w' },
+	{ "workers",            1, 0,                    'w' },
 #endif
 	{ 0, 0, 0, 0 }
 };
@@ -226,16 +302,17 @@ METHODDEF(void)	my_error_exit (j_common_ptr cinfo)
 
 METHODDEF(void) my_output_message (j_common_ptr cinfo)
 {
+	struct job_context *ctx = ((my_error_ptr)cinfo->err)->ctx;
 	char buffer[JMSG_LENGTH_MAX+1];
 
 	(*cinfo->err->format_message)((j_common_ptr)cinfo, buffer);
 	buffer[sizeof(buffer) - 1] = 0;
 
 	if (verbose_mode)
-		fprintf(jpeg_log_fh, " (%s) ", buffer);
+		fprintf(ctx->log_fh, " (%s) ", buffer);
 
-	global_error_counter++;
-	strncopy(last_error, buffer, sizeof(last_error));
+	ctx->error_counter++;
+	strncopy(ctx->last_error, buffer, sizeof(ctx->last_error));
 }
 
 
@@ -263,11 +340,29 @@ void print_usage(void)
 		"                    keep old file if the gain is below a threshold (%%)\n"
 #ifdef PARALLEL_PROCESSING
 		"  -w<max>, --workers=<max>\n"
-		"                    set maximum number of parallel threads (default is 1)\n"
+		"                    set maximum number of parallel threads (default is 1),\n"
+		"                    'auto' uses number of available CPUs, and '<n>x'\n"
+		"                    a multiple of it (for example: 0.5x)\n"
+		"  --adaptive        adjust number of active workers based on system load\n"
+		"                    (up to maximum set with -w, default is number of CPUs)\n"
+		"  --pin[=<cpus>]    pin each worker to a different CPU (optionally from\n"
+		"                    given list of CPUs, for example: 0-3,8)\n"
+#endif
+#ifdef WORKER_THREADS
+		"  --threads         use threads instead of processes for parallel processing\n"
+#endif
+#ifdef PARALLEL_PROCESSING
+		"  --max-memory=<size>\n"
+		"                    limit (estimated) memory used by parallel workers\n"
+		"                    to given size (suffixes K, M, G are supported)\n"
+		"  --ordered         output results in the same order as files are processed\n"
+		"                    (when using parallel workers)\n"
 #endif
 		"  -b, --csv         print progress info in CSV format\n"
 		"  -o, --overwrite   overwrite target file even if it exists (meaningful\n"
 		"                    only when used with -d, --dest option)\n"
+		"  --copy-skipped    copy files that were not optimized to the destination\n"
+		"                    directory as is (meaningful only with -d, --dest option)\n"
 		"  -p, --preserve    preserve file timestamps\n"
 		"  -P, --preserve-perms\n"
 		"                    preserve original file permissions by overwriting it\n"
@@ -309,9 +404,41 @@ void print_usage(void)
 		"  --stdin           read input from standard input (instead of a file)\n"
 		"  --files-stdin     Read names of files to process from stdin\n"
 		"  --files-from=FILE Read names of files to process from a file\n"
+		"  --read-mode=<mode>\n"
+		"                    how input files are read: mmap (default), read (whole\n"
+		"                    file at once), or stream\n"
+#ifdef HAVE_IO_URING
+		"  --io-uring        use io_uring for reading ahead input files and for\n"
+		"                    writing (and renaming) output files\n"
+#endif
+		"  --no-cache[=<size>]\n"
+		"                    drop input and output files from page cache after\n"
+		"                    processing (and read files larger than size directly\n"
+		"                    from disk, bypassing the cache)\n"
+#ifdef DEDUP_SUPPORT
+		"  --dedup[=<size>]  reuse results for identical input files (using table of\n"
+		"                    given size in shared memory, default is 256M)\n"
+#endif
+		"  --cache=<file>    remember results in a cache file, and skip files that\n"
+		"                    were already processed (with same options)\n"
+		"  --manifest=<file> keep list of processed files in a manifest file, and only\n"
+		"                    process files that have changed since the last run\n"
+		"  --journal=<file>  record completed files in a journal file\n"
+		"  --resume          continue an interrupted run, skipping files already\n"
+		"                    completed according to the journal (see --journal)\n"
+		"  --stamp           mark processed files with an extended attribute (" STAMP_XATTR ")\n"
+		"  --skip-stamped    skip files marked as processed (with same options)\n"
+		"  --prefetch=<n>    read ahead next n input files while processing current\n"
+		"                    files (default is 0, or %d with --io-uring)\n"
+		"  --order=<order>   order in which files are processed: input (default),\n"
+		"                    largest, smallest, or newest (first); other than input\n"
+		"                    order reads and checks whole file list before starting\n"
+		"  --fsync=<mode>    sync output files to disk: none (default), file (fsync\n"
+		"                    each file), or batch[:<files>[:<msec>]] (sync once per\n"
+		"                    directory every 100 files or 1000 ms)\n"
 		"  --nofix           skip processing of input files if they contain any errors\n"
 		"  --save-extra      preserve extraneous data after the end of image\n"
-		"\n\n");
+		"\n\n", PREFETCH_DEFAULT);
 }
 
 
@@ -470,15 +597,43 @@ void parse_arguments(int argc, char **argv, char *dest_path, size_t dest_path_le
 		case 'w':
 		        {
 				int tmpvar;
-				if (sscanf(optarg, "%d", &tmpvar) == 1) {
-					if (tmpvar > 0 && tmpvar <= MAX_WORKERS)
+				if ((tmpvar = parse_workers(optarg)) >= 0) {
+					if (tmpvar > MAX_WORKERS)
+						tmpvar = MAX_WORKERS;
+					if (tmpvar > 0)
 						max_workers = tmpvar;
 				}
 				else fatal("invalid argument for -w, --workers");
 			}
 			break;
+
+		case 'A':
+			pin_mode = 1;
+			if (optarg) {
+				int cpus[CPU_LIST_SIZE];
+
+				if (parse_cpu_list(optarg, cpus, CPU_LIST_SIZE) < 1)
+					fatal("invalid argument for --pin: %s", optarg);
+				pin_cpus = optarg;
+			}
+			break;
+
+		case 'M':
+			if ((max_memory = parse_size(optarg)) < 0)
+				fatal("invalid argument for --max-memory: %s", optarg);
+			break;
 #endif
 
+		case 'R':
+			read_mode = -1;
+			for (int i = 0; read_mode_names[i]; i++) {
+				if (!strcmp(optarg, read_mode_names[i]))
+					read_mode = i;
+			}
+			if (read_mode < 0)
+				fatal("invalid argument for --read-mode: %s", optarg);
+			break;
+
 		case 'F':
 		        {
 				if (optarg[0] == '-' && optarg[1] == 0) {
@@ -492,6 +647,49 @@ void parse_arguments(int argc, char **argv, char *dest_path, size_t dest_path_le
 			}
 			break;
 
+		case 'O':
+			if ((file_order = parse_file_order(optarg)) < 0)
+				fatal("invalid argument for --order: %s", optarg);
+			break;
+
+		case 'C':
+			nocache_mode = 1;
+			if (optarg && (nocache_direct = parse_size(optarg)) < 1)
+				fatal("invalid argument for --no-cache: %s", optarg);
+			break;
+
+		case 'c':
+			cache_file = optarg;
+			break;
+
+		case 'N':
+			manifest_file = optarg;
+			break;
+
+		case 'J':
+			journal_file = optarg;
+			break;
+
+#ifdef DEDUP_SUPPORT
+		case 'D':
+			dedup_mode = 1;
+			if (optarg && (dedup_size = parse_size(optarg)) < 1)
+				fatal("invalid argument for --dedup: %s", optarg);
+			break;
+#endif
+
+		case 'H':
+			if (sscanf(optarg, "%d", &prefetch_depth) != 1 ||
+				prefetch_depth < 0 || prefetch_depth > LOOKAHEAD_MAX)
+				fatal("invalid argument for --prefetch: %s", optarg);
+			break;
+
+		case 'Y':
+			if ((fsync_mode = parse_fsync_mode(optarg, &fsync_batch_files,
+								&fsync_batch_time)) < 0)
+				fatal("invalid argument for --fsync: %s", optarg);
+			break;
+
 		case '?':
 			exit(1);
 
@@ -515,8 +713,20 @@ void parse_arguments(int argc, char **argv, char *dest_path, size_t dest_path_le
 		fatal("cannot specify both --stdin and --files-stdin");
 	if (all_normal && all_progressive)
 		fatal("cannot specify both --all-normal and --all-progressive");
+	if (resume_mode && !journal_file)
+		fatal("--resume requires --journal");
 	if (auto_mode && (all_normal || all_progressive))
 		fatal("cannot specify --all-normal or --all-progressive if using --auto-mode");
+#if defined(WORKER_THREADS) && !defined(WORKER_PROCESSES)
+	thread_mode = 1;
+#endif
+#ifdef PARALLEL_PROCESSING
+	if (adaptive_mode && max_workers < 2) {
+		max_workers = available_cpus();
+		if (max_workers > MAX_WORKERS)
+			max_workers = MAX_WORKERS;
+	}
+#endif
 }
 
 
@@ -529,7 +739,7 @@ void own_signal_handler(int a)
 
 
 void write_markers(struct jpeg_decompress_struct *dinfo,
-		struct jpeg_compress_struct *cinfo)
+		struct jpeg_compress_struct *cinfo, FILE *log_fh)
 {
 	jpeg_saved_marker_ptr mrk;
 	int write_marker;
@@ -577,7 +787,7 @@ void write_markers(struct jpeg_decompress_struct *dinfo,
 
 
 		if (verbose_mode > 2)
-			fprintf(jpeg_log_fh, " (Marker %s [%s]: %s)", jpeg_marker_name(mrk->marker),
+			fprintf(log_fh, " (Marker %s [%s]: %s)", jpeg_marker_name(mrk->marker),
 				s_name, (write_marker ? "Keep" : "Discard"));
 		if (write_marker)
 			jpeg_write_marker(cinfo, mrk->marker, mrk->data, mrk->data_length);
@@ -628,10 +838,35 @@ unsigned int parse_markers(const struct jpeg_decompress_struct *dinfo,
 }
 
 
+long long estimate_memory(const char *filename, const struct stat *file_stat)
+{
+	FILE *fp;
+	unsigned int width = 0, height = 0;
+	int components = 0, progressive = 0;
+	long long samples = 0;
+	long long insize = file_stat->st_size;
+
+	if ((fp = fopen(filename, "rb"))) {
+		if (jpeg_read_frame_header(fp, &width, &height, &components, &progressive) < 0)
+			width = height = components = 0;
+		fclose(fp);
+	}
+	samples = (long long)width * height * components;
+
+	/*
+	 * Peak memory of optimize(): full image coefficient arrays (when decoding
+	 * progressive, in lossless mode, and when compressing), decoded image
+	 * (in lossy mode), plus input, output, and tmp buffers.
+	 */
+	return samples * sizeof(JCOEF) * (quality >= 0 && progressive ? 2 : 1)
+		+ (quality >= 0 ? samples : 0)
+		+ insize * 3 + 32768 + 1024 * 1024;
+}
+
 
 int optimize(FILE *log_fh, const char *filename, const char *newname,
 	const char *tmpdir, struct stat *file_stat,
-	double *rate, double *saved)
+	struct job_result *result)
 {
 	FILE *infile = NULL;
 	FILE *outfile = NULL;
@@ -642,21 +877,31 @@ int optimize(FILE *log_fh, const char *filename, const char *newname,
 	struct my_error_mgr jcerr, jderr;
 	JSAMPARRAY buf = NULL;
 
-	unsigned char *outbuffer = NULL;
-	size_t outbuffersize = 0;
+	struct seg_buffer outbuf;
 	unsigned char *inbuffer = NULL;
 	size_t inbuffersize = 0;
 	size_t inbufferused = 0;
-	unsigned char *tmpbuffer = NULL;
-	size_t tmpbuffersize = 0;
+	/* (variables changed after setjmp() and used after longjmp() must be volatile) */
+	volatile int inbuffer_mode = READ_STREAM;
+	volatile int cache_fd = -1;
+	unsigned char indigest[SHA256_SIZE];
+	volatile int have_digest = 0;
+#ifdef DEDUP_SUPPORT
+	struct dedup_info dd;
+	volatile uint64_t inhash = 0;
+#endif
+	volatile int duplicate = 0;
+	struct seg_buffer tmpbuf;
 	unsigned char *extrabuffer = NULL;
 	size_t extrabuffersize = 0;
+	unsigned char *extradata = NULL;
 
 	jvirt_barray_ptr *coef_arrays = NULL;
 	char marker_str[256];
 	unsigned int marker_in_count, marker_in_size;
 
 	long in_image_size = 0;
+	long fsize;
 	long insize = 0, outsize = 0, lastsize = 0;
 	int oldquality, searchdone;
 	double ratio;
@@ -664,8 +909,23 @@ int optimize(FILE *log_fh, const char *filename, const char *newname,
 	int retry_count = 0;
 	int retry = 0;
 	int res = -1;
+	double t;
+
+	struct job_context ctx;
+	struct job_result stats;
+	struct output_params outp, tmpp;
+#ifdef HAVE_O_TMPFILE
+	volatile int unnamed = 0;
+#endif
 
-	jpeg_log_fh = log_fh;
+	/* Initialize per job state from global settings */
+	ctx.log_fh = log_fh;
+	ctx.quality = quality;
+	ctx.auto_mode = auto_mode;
+	ctx.all_normal = all_normal;
+	ctx.all_progressive = all_progressive;
+	ctx.error_counter = 0;
+	ctx.last_error[0] = 0;
 
 	/* Initialize decompression object */
 	dinfo.err = jpeg_std_error(&jderr.pub);
@@ -673,6 +933,7 @@ int optimize(FILE *log_fh, const char *filename, const char *newname,
 	jderr.pub.error_exit=my_error_exit;
 	jderr.pub.output_message=my_output_message;
 	jderr.jump_set = 0;
+	jderr.ctx = &ctx;
 
 	/* Initialize compression object */
 	cinfo.err = jpeg_std_error(&jcerr.pub);
@@ -680,11 +941,15 @@ int optimize(FILE *log_fh, const char *filename, const char *newname,
 	jcerr.pub.error_exit=my_error_exit;
 	jcerr.pub.output_message=my_output_message;
 	jcerr.jump_set = 0;
+	jcerr.ctx = &ctx;
 
-	if (rate)
-		*rate = 0.0;
-	if (saved)
-		*saved = 0.0;
+	memset(&stats, 0, sizeof(stats));
+	stats.size = -1;
+	memset(&outbuf, 0, sizeof(outbuf));
+	memset(&tmpbuf, 0, sizeof(tmpbuf));
+	outp.quality = tmpp.quality = -1;
+	outp.progressive = tmpp.progressive = 0;
+	outp.arith = tmpp.arith = 0;
 
 	if (filename) {
 		if ((infile = fopen(filename, "rb")) == NULL) {
@@ -699,6 +964,7 @@ int optimize(FILE *log_fh, const char *filename, const char *newname,
 
 retry_point:
 
+	t = get_time();
 	if (setjmp(jderr.setjmp_buffer)) {
 		/* Error handler for decompress */
 	abort_decompress:
@@ -722,29 +988,75 @@ retry_point:
 			fflush(log_fh);
 		}
 
-		if (stdin_mode || stdout_mode) {
-			inbuffersize = IN_BUF_SIZE;
+		fsize = (filename ? file_size(infile) : -1);
+		if (nocache_direct > 0 && fsize >= nocache_direct &&
+			(inbuffer = read_file_direct(filename, fsize, &inbuffersize, &inbufferused))) {
+			/* Read (large) file directly, without polluting page cache */
+			inbuffer_mode = READ_WHOLE;
+		} else if (fsize > 0 && read_mode == READ_MMAP &&
+			(inbuffer = map_file(infile, &inbuffersize))) {
+			/* Decode directly from the mapped file (no need to copy it) */
+			inbuffer_mode = READ_MMAP;
+			inbufferused = inbuffersize;
+		} else if (fsize > 0 && read_mode == READ_WHOLE) {
+			/* Read whole file at once, and decode from memory */
+			inbuffersize = fsize;
+			if (!(inbuffer = malloc(inbuffersize)))
+				fatal("not enough memory");
+			inbufferused = readn(fileno(infile), inbuffer, inbuffersize);
+			inbuffer_mode = READ_WHOLE;
 		} else {
-			if ((inbuffersize = file_size(infile)) < IN_BUF_SIZE)
+			if (stdin_mode || stdout_mode) {
 				inbuffersize = IN_BUF_SIZE;
+			} else {
+				if ((inbuffersize = file_size(infile)) < IN_BUF_SIZE)
+					inbuffersize = IN_BUF_SIZE;
+			}
+			if (!(inbuffer=calloc(inbuffersize, 1)))
+				fatal("not enough memory");
+		}
+
+		if (cache_file && filename && inbuffer_mode != READ_STREAM) {
+			/* Check if a file with identical contents was processed earlier
+			   (done here, as file has been read already) */
+			struct sha256_ctx sha;
+			int cached;
+
+			sha256_init(&sha);
+			sha256_update(&sha, inbuffer, inbufferused);
+			sha256_final(&sha, indigest);
+			have_digest = 1;
+			if (!dest && (cached = cache_lookup_content(file_stat, indigest))) {
+				if (csv)
+					fprintf(log_fh, ",,,%ld,%ld,0.00,skipped\n", fsize, fsize);
+				else if (!quiet_mode)
+					fprintf(log_fh, "[cached] %ld --> %ld bytes (0.00%%), skipped.\n",
+						fsize, fsize);
+				fclose(infile);
+				stats.insize = stats.outsize = fsize;
+				stats.cached = cached;
+				stats.size = file_stat->st_size;
+				stats.mtime = file_mtime(file_stat);
+				res = 0;
+				goto exit_point;
+			}
 		}
-		if (inbuffer)
-			free(inbuffer);
-		if (!(inbuffer=calloc(inbuffersize, 1)))
-			fatal("not enough memory");
 	}
-	global_error_counter=0;
+	ctx.error_counter=0;
 	jpeg_save_markers(&dinfo, JPEG_COM, 0xffff);
 	for (int i = 0; i < 16; i++) {
 		jpeg_save_markers(&dinfo, JPEG_APP0 + i, 0xffff);
 	}
 	if (!retry) {
-		jpeg_custom_src(&dinfo, infile, &inbuffer, &inbuffersize, &inbufferused, IN_BUF_SIZE);
+		if (inbuffer_mode != READ_STREAM)
+			jpeg_custom_mem_src(&dinfo, inbuffer, inbufferused);
+		else
+			jpeg_custom_src(&dinfo, infile, &inbuffer, &inbuffersize, &inbufferused, IN_BUF_SIZE);
 	} else {
 		if (retry == 1)
 			jpeg_custom_mem_src(&dinfo, inbuffer, inbufferused);
 		else
-			jpeg_custom_mem_src(&dinfo, tmpbuffer, tmpbuffersize);
+			jpeg_segment_src(&dinfo, &tmpbuf);
 	}
 	jpeg_read_header(&dinfo, TRUE);
 
@@ -770,8 +1082,21 @@ retry_point:
 		}
 	}
 
+#ifdef DEDUP_SUPPORT
+	if (dedup_mode && !retry && inbuffer_mode != READ_STREAM) {
+		/* Check if identical file was already processed */
+		inhash = content_hash(0, inbuffer, inbufferused);
+		duplicate = dedup_lookup(inhash, inbuffer, inbufferused, &dd, &outbuf);
+	}
+#endif
+
 	/* Decompress the image */
-	if (quality >= 0 && retry != 1) {
+	if (duplicate) {
+#ifdef DEDUP_SUPPORT
+		/* Output is already known, no need to decode the image */
+		ctx.error_counter = dd.error_counter;
+#endif
+	} else if (ctx.quality >= 0 && retry != 1) {
 		jpeg_start_decompress(&dinfo);
 
 		/* Allocate line buffer to store the decompressed image */
@@ -795,8 +1120,13 @@ retry_point:
 			goto abort_decompress;
 		}
 	}
+	stats.decode_time += get_time() - t;
 	if (!retry) {
 		in_image_size = inbufferused - dinfo.src->bytes_in_buffer;
+#ifdef DEDUP_SUPPORT
+		if (duplicate)
+			in_image_size = dd.in_image_size;
+#endif
 		if(verbose_mode > 2)
 			fprintf(log_fh, " (input image size: %lu (%lu))",
 				in_image_size, inbufferused);
@@ -810,26 +1140,32 @@ retry_point:
 					fprintf(log_fh, " (%lu bytes extraneous data found after end of image) ",
 						insize - in_image_size);
 				if (nofix_mode)
-					global_error_counter++;
+					ctx.error_counter++;
 				if (save_extra) {
 					extrabuffersize = insize - in_image_size;
-					if (extrabuffer)
-						free(extrabuffer);
-					if (!(extrabuffer = calloc(extrabuffersize, 1)))
-						fatal("not enough memory");
-					if (fseek(infile, in_image_size, SEEK_SET))
-						fatal("failed to seek input file");
-					if (fread(extrabuffer, extrabuffersize, 1, infile) != 1)
-						fatal("failed to read inputfile");
+					if ((size_t)insize <= inbufferused) {
+						/* Extra data is already in the input buffer */
+						extradata = inbuffer + in_image_size;
+					} else {
+						if (extrabuffer)
+							free(extrabuffer);
+						if (!(extrabuffer = calloc(extrabuffersize, 1)))
+							fatal("not enough memory");
+						if (fseek(infile, in_image_size, SEEK_SET))
+							fatal("failed to seek input file");
+						if (fread(extrabuffer, extrabuffersize, 1, infile) != 1)
+							fatal("failed to read inputfile");
+						extradata = extrabuffer;
+					}
 				}
 			}
 		}
 		if (!quiet_mode) {
-			fprintf(log_fh,(global_error_counter==0 ? " [OK] " : " [WARNING] "));
+			fprintf(log_fh,(ctx.error_counter==0 ? " [OK] " : " [WARNING] "));
 			fflush(log_fh);
 		}
 
-		if (nofix_mode && global_error_counter != 0) {
+		if (nofix_mode && ctx.error_counter != 0) {
 			/* Skip files containing any errors (or warnings) */
 			goto abort_decompress;
 		}
@@ -844,11 +1180,26 @@ retry_point:
 	}
 
 
+#ifdef DEDUP_SUPPORT
+	if (duplicate) {
+		/* Use output of the identical file */
+		jpeg_abort_decompress(&dinfo);
+		outp.quality = dd.quality;
+		outp.progressive = dd.progressive;
+		outp.arith = dd.arith;
+		outsize = dd.outlen + extrabuffersize;
+		stats.dedup = 1;
+		if (verbose_mode)
+			fprintf(log_fh, "(duplicate) ");
+		goto compress_done;
+	}
+#endif
+
 	/* Prepare to compress... */
 	if (setjmp(jcerr.setjmp_buffer)) {
 		/* Error handler for compress failures */
 		if (!quiet_mode)
-			fprintf(log_fh," [Compress ERROR: %s]\n",last_error);
+			fprintf(log_fh," [Compress ERROR: %s]\n",ctx.last_error);
 		jpeg_abort_compress(&cinfo);
 		jpeg_abort_decompress(&dinfo);
 		fclose(infile);
@@ -866,25 +1217,20 @@ retry_point:
 		oldquality = 200;
 		if (target_size != 0) {
 			/* Always start with quality 100 if -S option specified... */
-			quality = 100;
+			ctx.quality = 100;
 		}
 	}
 
 
 binary_search_loop:
 
-	/* Allocate memory buffer that should be large enough to store the output JPEG... */
-	if (outbuffer)
-		free(outbuffer);
-	outbuffersize = insize + 32768;
-	if (!(outbuffer=calloc(outbuffersize, 1)))
-		fatal("not enough memory");
-
-	/* setup custom "destination manager" for libjpeg to write to our buffer */
-	jpeg_memory_dest(&cinfo, &outbuffer, &outbuffersize, 65536);
+	t = get_time();
+	/* setup custom "destination manager" for libjpeg to write to our (segmented) buffer,
+	   segments already in the buffer get reused */
+	jpeg_segment_dest(&cinfo, &outbuf);
 
 
-	if (quality >= 0 && retry != 1) {
+	if (ctx.quality >= 0 && retry != 1) {
 		/* Lossy "optimization" ... */
 
 		cinfo.in_color_space=dinfo.out_color_space;
@@ -892,16 +1238,16 @@ binary_search_loop:
 		cinfo.image_width=dinfo.image_width;
 		cinfo.image_height=dinfo.image_height;
 		jpeg_set_defaults(&cinfo);
-		jpeg_set_quality(&cinfo,quality,TRUE);
+		jpeg_set_quality(&cinfo,ctx.quality,TRUE);
 #ifdef HAVE_JINT_DC_SCAN_OPT_MODE
 		if (jpeg_c_int_param_supported(&cinfo, JINT_DC_SCAN_OPT_MODE))
 			jpeg_c_set_int_param(&cinfo, JINT_DC_SCAN_OPT_MODE, 1);
 #endif
-		if (all_normal || (!dinfo.progressive_mode && !all_progressive)) {
+		if (ctx.all_normal || (!dinfo.progressive_mode && !ctx.all_progressive)) {
 			/* Explicitly disable progressive mode. */
 			cinfo.scan_info = NULL;
 			cinfo.num_scans = 0;
-		} else if (all_progressive || dinfo.progressive_mode) {
+		} else if (ctx.all_progressive || dinfo.progressive_mode) {
 			/* Enable progressive mode. */
 			jpeg_simple_progression(&cinfo);
 		}
@@ -923,7 +1269,7 @@ binary_search_loop:
 		jpeg_start_compress(&cinfo,TRUE);
 
 		/* Write markers */
-		write_markers(&dinfo,&cinfo);
+		write_markers(&dinfo, &cinfo, log_fh);
 
 		/* Write image */
 		while (cinfo.next_scanline < cinfo.image_height) {
@@ -939,11 +1285,11 @@ binary_search_loop:
 		if (jpeg_c_int_param_supported(&cinfo, JINT_DC_SCAN_OPT_MODE))
 			jpeg_c_set_int_param(&cinfo, JINT_DC_SCAN_OPT_MODE, 1);
 #endif
-		if (all_normal || (!dinfo.progressive_mode && !all_progressive)) {
+		if (ctx.all_normal || (!dinfo.progressive_mode && !ctx.all_progressive)) {
 			/* Explicitly disable progressive mode. */
 			cinfo.scan_info = NULL;
 			cinfo.num_scans = 0;
-		} else if (all_progressive || dinfo.progressive_mode) {
+		} else if (ctx.all_progressive || dinfo.progressive_mode) {
 			/* Enable progressive mode. */
 			jpeg_simple_progression(&cinfo);
 		}
@@ -966,12 +1312,19 @@ binary_search_loop:
 		jpeg_write_coefficients(&cinfo, coef_arrays);
 
 		/* Write markers */
-		write_markers(&dinfo,&cinfo);
+		write_markers(&dinfo, &cinfo, log_fh);
 
 	}
 
 	jpeg_finish_compress(&cinfo);
-	outsize = outbuffersize + extrabuffersize;
+	stats.encode_time += get_time() - t;
+	stats.trials++;
+	outp.quality = (ctx.quality >= 0 && retry != 1 ? ctx.quality : -1);
+	outp.progressive = (cinfo.progressive_mode ? 1 : 0);
+#ifdef HAVE_ARITH_CODE
+	outp.arith = (cinfo.arith_code ? 1 : 0);
+#endif
+	outsize = outbuf.used + extrabuffersize;
 	if (verbose_mode > 2)
 		fprintf(log_fh, " (output image size: %lu (%lu))", outsize,extrabuffersize);
 
@@ -996,7 +1349,7 @@ binary_search_loop:
 					if (verbose_mode)
 						fprintf(log_fh,"(revert to %d)",oldquality);
 					searchdone = 42;
-					quality = oldquality;
+					ctx.quality = oldquality;
 					goto binary_search_loop;
 				}
 			}
@@ -1005,12 +1358,12 @@ binary_search_loop:
 
 		} else {
 			int newquality;
-			double dif = abs(oldquality-quality) / 2.0;
+			double dif = abs(oldquality-ctx.quality) / 2.0;
 
 			if (osize > tsize)
-				newquality = quality - dif;
+				newquality = ctx.quality - dif;
 			else
-				newquality = quality + dif + 0.5;
+				newquality = ctx.quality + dif + 0.5;
 
 			if (dif < 1.0)
 				searchdone = 1;
@@ -1023,11 +1376,11 @@ binary_search_loop:
 				searchdone = 1;
 			}
 
-			oldquality = quality;
-			quality = newquality;
+			oldquality = ctx.quality;
+			ctx.quality = newquality;
 			lastsize = osize;
 			if (verbose_mode)
-				fprintf(log_fh,"(try %d)",quality);
+				fprintf(log_fh,"(try %d)",ctx.quality);
 			goto binary_search_loop;
 		}
 	}
@@ -1036,17 +1389,14 @@ binary_search_loop:
 	free_line_buf(&buf, dinfo.output_height);
 
 	if (retry_mode) {
-		if ((retry == 0 || retry == 2) && quality >= 0 && outsize <= insize) {
+		if ((retry == 0 || retry == 2) && ctx.quality >= 0 && outsize <= insize) {
 			/* Retry compression until output file stops getting smaller
 			   or we hit max limit of iterations (10)... */
 			if (retry_count == 0)
 				last_retry_size = outsize + 1;
 			if (++retry_count < 10 && outsize < last_retry_size) {
-				if (tmpbuffer)
-					free(tmpbuffer);
-				tmpbuffer = outbuffer;
-				tmpbuffersize = outbuffersize;
-				outbuffer = NULL;
+				seg_buffer_swap(&tmpbuf, &outbuf);
+				tmpp = outp;
 				last_retry_size = outsize;
 				retry = 2;
 				if (verbose_mode)
@@ -1058,29 +1408,23 @@ binary_search_loop:
 			if (verbose_mode)
 				fprintf(log_fh, "(retry done: %lu) ", outsize);
 			if (outsize > last_retry_size) {
-				if (outbuffer)
-					free(outbuffer);
-				outbuffer = tmpbuffer;
-				outbuffersize = tmpbuffersize;
-				outsize = outbuffersize + extrabuffersize;
-				tmpbuffer = NULL;
+				seg_buffer_swap(&outbuf, &tmpbuf);
+				outp = tmpp;
+				outsize = outbuf.used + extrabuffersize;
 			}
 		}
 	}
 
 	/* If auto_mode, try both progressive and non-progressive... */
-	if (auto_mode) {
+	if (ctx.auto_mode) {
 		int newmode = (dinfo.progressive_mode ? 0 : 1);
 		if (retry != 3) {
 			if (newmode)
-				all_progressive = 1;
+				ctx.all_progressive = 1;
 			else
-				all_normal = 1;
-			if (tmpbuffer)
-				free(tmpbuffer);
-			tmpbuffer = outbuffer;
-			tmpbuffersize = outbuffersize;
-			outbuffer = NULL;
+				ctx.all_normal = 1;
+			seg_buffer_swap(&tmpbuf, &outbuf);
+			tmpp = outp;
 			last_retry_size = outsize;
 			retry = 3;
 			if (verbose_mode)
@@ -1089,43 +1433,60 @@ binary_search_loop:
 		} else {
 			if (verbose_mode > 1)
 				fprintf(log_fh, "(automode done: %lu) ", outsize);
-			auto_mode = 0;
+			ctx.auto_mode = 0;
 			if (outsize > last_retry_size) {
 				if (verbose_mode)
 					fprintf(log_fh, "(revert to %s) ", (!newmode ? "progressive" : "normal"));
-				all_progressive = 0;
-				all_normal = 0;
-				if (outbuffer)
-					free(outbuffer);
-				outbuffer = tmpbuffer;
-				outbuffersize = tmpbuffersize;
-				outsize = outbuffersize + extrabuffersize;
-				tmpbuffer = NULL;
+				ctx.all_progressive = 0;
+				ctx.all_normal = 0;
+				seg_buffer_swap(&outbuf, &tmpbuf);
+				outp = tmpp;
+				outsize = outbuf.used + extrabuffersize;
 			}
 		}
 	}
 
 	/* In case "lossy" compression resulted larger file than original, retry with "lossless"... */
-	if (quality >= 0 && outsize >= insize && retry != 1) {
+	if (ctx.quality >= 0 && outsize >= insize && retry != 1) {
 		retry = 1;
 		if (verbose_mode)
 			fprintf(log_fh, "(retry w/lossless) ");
 		goto retry_point;
 	}
 
+#ifdef DEDUP_SUPPORT
+	if (dedup_mode && inhash) {
+		/* Save result (output only if it is going to be used) for identical files */
+		dd.in_image_size = in_image_size;
+		dd.error_counter = ctx.error_counter;
+		dd.quality = outp.quality;
+		dd.progressive = outp.progressive;
+		dd.arith = outp.arith;
+		dd.outlen = outbuf.used;
+		dedup_store(inhash, inbuffer, inbufferused, &dd,
+			(outsize < insize || force ? &outbuf : NULL));
+	}
+ compress_done:
+#endif
+	if (nocache_mode && filename) {
+		/* Drop input file from cache only after it has been unmapped */
+		cache_fd = dup(fileno(infile));
+	}
 	fclose(infile);
 
 	ratio = (insize - outsize) * 100.0 / insize;
 	if (!quiet_mode || csv)
 		fprintf(log_fh,csv ? "%ld,%ld,%0.2f," : "%ld --> %ld bytes (%0.2f%%), ",insize,outsize,ratio);
-	if (rate) {
-		*rate = (ratio < 0 ? 0.0 : ratio);
-	}
+	stats.insize = insize;
+	stats.outsize = outsize;
+	stats.rate = (ratio < 0 ? 0.0 : ratio);
+	stats.quality = outp.quality;
+	stats.progressive = outp.progressive;
+	stats.arith = outp.arith;
 
 	if ((outsize < insize && ratio >= threshold) || force) {
-		if (saved) {
-			*saved = (insize - outsize) / 1024.0;
-		}
+		stats.optimized = 1;
+		stats.saved = (insize - outsize) / 1024.0;
 		if (!quiet_mode || csv)
 			fprintf(log_fh,csv ? "optimized\n" : "optimized.\n");
 		if (noaction) {
@@ -1133,10 +1494,13 @@ binary_search_loop:
 			goto exit_point;
 		}
 
+		t = get_time();
+
 		if (stdout_mode) {
 			outfname=NULL;
 			set_filemode_binary(stdout);
-			if (fwrite(outbuffer,outbuffersize,1,stdout) != 1)
+			fflush(stdout);
+			if (seg_buffer_write(fileno(stdout), &outbuf, NULL, 0) != outbuf.used)
 				fatal("%s, write failed to stdout",(stdin_mode ? "stdin" : filename));
 		} else {
 			if (preserve_perms && !dest) {
@@ -1159,6 +1523,12 @@ binary_search_loop:
 					fatal("%s, error opening output file: %s",
 						(stdin_mode ? "stdin" : filename), newname);
 				outfname = newname;
+#ifdef HAVE_O_TMPFILE
+			} else if ((outfile = create_unnamed_file(tmpdir))) {
+				/* File gets linked to its final name only after it has been written */
+				unnamed = 1;
+				outfname = newname;
+#endif
 			} else {
 				if (!(outfile = create_temp_file(tmpdir, "jpegoptim", tmpfilename, sizeof(tmpfilename))))
 					fatal("error creating temporary file: %s", tmpfilename);
@@ -1167,16 +1537,117 @@ binary_search_loop:
 
 			if (verbose_mode > 1)
 				fprintf(log_fh,"writing %lu bytes to file: %s\n",
-					(long unsigned int)outbuffersize, outfname);
-			if (fwrite(outbuffer, outbuffersize, 1, outfile) != 1)
-				fatal("write failed to file: %s", outfname);
+					(long unsigned int)outbuf.used, outfname);
 			if (save_extra && extrabuffersize > 0) {
 				if (verbose_mode > 1)
 					fprintf(log_fh,"writing %lu bytes to file: %s\n", extrabuffersize, outfname);
-				if (fwrite(extrabuffer, extrabuffersize, 1, outfile) != 1)
+			}
+#ifdef HAVE_O_TMPFILE
+			if (unnamed) {
+				/* Set file mode, owner (and time) using the file descriptor, and then
+				   link fully written file to the target (instead of path based calls) */
+				int fd = fileno(outfile);
+				int r = -1;
+
+				if (fchmod(fd, (file_stat->st_mode & 0777)) != 0)
+					warn("failed to set output file mode");
+				if (fchown(fd, (geteuid()==0 ? file_stat->st_uid : (uid_t)-1),
+						file_stat->st_gid) != 0)
+					warn("failed to reset output file group/owner");
+				if (verbose_mode > 1)
+					fprintf(log_fh,"linking: %s\n", newname);
+#ifdef HAVE_IO_URING
+				if (io_uring_mode) {
+					struct iovec iov[URING_IOV_MAX];
+					char fdpath[64], linkname[MAXPATHLEN + 1];
+					int n;
+
+					if ((n = seg_buffer_iov(&outbuf, extradata,
+									(save_extra ? extrabuffersize : 0),
+									iov, URING_IOV_MAX)) > 0 &&
+						unnamed_link_name(fd, tmpdir, linkname, sizeof(linkname)))
+						r = uring_write_rename(fd, iov, n, outsize,
+								(preserve_mode ? &file_stat->st_mtim : NULL),
+								(fsync_mode == FSYNC_FILE),
+								unnamed_file_path(fd, fdpath, sizeof(fdpath)),
+								(dest ? NULL : linkname), newname);
+					if (r == -4) {
+						/* Target already exists (or linkat not supported by io_uring) */
+						r = (link_file(fd, tmpdir, newname, 1) ? -3 : 0);
+					}
+				}
+#endif
+				if (r == -1) {
+					if (seg_buffer_write(fd, &outbuf, extradata,
+								(save_extra ? extrabuffersize : 0)) != (size_t)outsize)
+						fatal("write failed to file: %s", newname);
+					if (preserve_mode) {
+						struct timespec time_save[2];
+
+						if (verbose_mode > 1)
+							fprintf(log_fh,"set file modification time same as in original: %s\n",
+								newname);
+						time_save[0].tv_sec = 0;
+						time_save[0].tv_nsec = UTIME_OMIT;	/* omit atime */
+						time_save[1] = file_stat->st_mtim;
+						if (futimens(fd, time_save) != 0)
+							warn("failed to reset output file time/date");
+					}
+					stats.sync_time += sync_file(fd);
+					r = (link_file(fd, tmpdir, newname, !dest) ? -3 : 0);
+				}
+				if (r == -2)
+					fatal("write failed to file: %s", newname);
+				if (r == -3)
+					fatal("cannot link output file: %s", newname);
+				if (nocache_mode)
+					drop_file_cache(fd, 1);
+				fclose(outfile);
+				outfname = NULL;
+			}
+#endif
+#ifdef HAVE_IO_URING
+			if (io_uring_mode && outfname == tmpfilename) {
+				/* Set file mode and owner first, then write and rename file
+				   with one (linked) io_uring submission */
+				struct iovec iov[URING_IOV_MAX];
+				int n, r = -1;
+
+				if (fchmod(fileno(outfile), (file_stat->st_mode & 0777)) != 0)
+					warn("failed to set output file mode");
+				if (fchown(fileno(outfile),
+						(geteuid()==0 ? file_stat->st_uid : (uid_t)-1),
+						file_stat->st_gid) != 0)
+					warn("failed to reset output file group/owner");
+				if (verbose_mode > 1)
+					fprintf(log_fh,"renaming: %s to %s\n", outfname, newname);
+				if ((n = seg_buffer_iov(&outbuf, extradata, (save_extra ? extrabuffersize : 0),
+								iov, URING_IOV_MAX)) > 0)
+					r = uring_write_rename(fileno(outfile), iov, n, outsize,
+							(preserve_mode ? &file_stat->st_mtim : NULL),
+							(fsync_mode == FSYNC_FILE), NULL, outfname, newname);
+				if (r == -2)
+					fatal("write failed to file: %s", outfname);
+				if (r == -3)
+					fatal("cannot rename temp file");
+				if (r == 0) {
+					if (nocache_mode)
+						drop_file_cache(fileno(outfile), 1);
+					fclose(outfile);
+					outfname = NULL;
+				}
+			}
+#endif
+			if (outfname) {
+				/* Write image (segments) and extra data with vectored writes */
+				if (seg_buffer_write(fileno(outfile), &outbuf, extradata,
+							(save_extra ? extrabuffersize : 0)) != (size_t)outsize)
 					fatal("write failed to file: %s", outfname);
+				stats.sync_time += sync_file(fileno(outfile));
+				if (nocache_mode)
+					drop_file_cache(fileno(outfile), 1);
+				fclose(outfile);
 			}
-			fclose(outfile);
 		}
 
 		if (outfname) {
@@ -1226,6 +1697,9 @@ binary_search_loop:
 					fatal("cannot rename temp file");
 			}
 		}
+		if (!stdout_mode)
+			stats.sync_time += sync_commit(log_fh, newname);
+		stats.write_time = get_time() - t - stats.sync_time;
 	} else {
 		if (!quiet_mode || csv)
 			fprintf(log_fh,csv ? "skipped\n" : "skipped.\n");
@@ -1234,112 +1708,184 @@ binary_search_loop:
 			if (fwrite(inbuffer, in_image_size, 1, stdout) != 1)
 				fatal("%s, write failed to stdout",
 					(stdin_mode ? "stdin" : filename));
+		} else if (copy_skipped && dest && !noaction && !stdin_mode) {
+			/* Copy original file to the destination (using reflink if possible) */
+			if (verbose_mode > 1)
+				fprintf(log_fh,"copying original file to: %s\n", newname);
+			if (copy_file(filename, newname))
+				fatal("%s, failed to copy file to: %s", filename, newname);
+			if (chmod(newname, (file_stat->st_mode & 0777)) != 0)
+				warn("failed to set output file mode");
+			if (chown(newname, (geteuid()==0 ? file_stat->st_uid : (uid_t)-1),
+					file_stat->st_gid) != 0)
+				warn("failed to reset output file group/owner");
+#if defined(HAVE_UTIMENSAT) && defined(HAVE_STRUCT_STAT_ST_MTIM)
+			if (preserve_mode) {
+				struct timespec time_save[2];
+				time_save[0].tv_sec = 0;
+				time_save[0].tv_nsec = UTIME_OMIT;	/* omit atime */
+				time_save[1] = file_stat->st_mtim;
+				if (utimensat(AT_FDCWD, newname, time_save, 0) != 0)
+					warn("failed to reset output file time/date");
+			}
+#endif
+			stats.sync_time += sync_commit(log_fh, newname);
+		}
+	}
+
+	if (stamp_mode && filename && !noaction && !stdout_mode) {
+		/* Mark output (or the original file, if it was not replaced) as processed */
+		const char *name = (stats.optimized ? newname : filename);
+		long long size = (stats.optimized ? outsize : insize);
+
+		if (write_stamp(name, VERSION, settings_hash, size) != 0 && !stamp_warned) {
+			warn("failed to set extended attribute on: %s", name);
+			stamp_warned = 1;
+		}
+	}
+
+	if (cache_file && filename && !noaction && !stdout_mode) {
+		/* Remember result, so file can be skipped on later runs */
+		struct stat st;
+
+		if (stats.optimized && !dest) {
+			unsigned char digest[SHA256_SIZE];
+
+			seg_buffer_digest(&outbuf, extradata, (save_extra ? extrabuffersize : 0),
+					digest);
+			if (stat(newname, &st) == 0)
+				cache_store(&st, digest, CACHE_OPTIMIZED);
+		} else if (have_digest || content_digest_file(filename, indigest) == 0) {
+			cache_store(file_stat, indigest,
+				(stats.optimized ? CACHE_OPTIMIZED : CACHE_SKIPPED));
+		}
+	}
+
+	if (filename && !noaction && !stdout_mode) {
+		/* Size and timestamp of the (input) file now, for --manifest */
+		struct stat st;
+
+		if (stats.optimized && !dest) {
+			if (stat(newname, &st) == 0) {
+				stats.size = st.st_size;
+				stats.mtime = file_mtime(&st);
+			}
+		} else {
+			stats.size = file_stat->st_size;
+			stats.mtime = file_mtime(file_stat);
 		}
 	}
 
 	res = 0;
 
  exit_point:
-	if (inbuffer)
+	if (inbuffer_mode == READ_MMAP)
+		unmap_file(inbuffer, inbuffersize);
+	else if (inbuffer)
 		free(inbuffer);
-	if (outbuffer)
-		free(outbuffer);
-	if (tmpbuffer)
-		free(tmpbuffer);
+	if (cache_fd >= 0) {
+		drop_file_cache(cache_fd, 0);
+		close(cache_fd);
+	}
+	seg_buffer_free(&outbuf);
+	seg_buffer_free(&tmpbuf);
 	if (extrabuffer)
 		free(extrabuffer);
 	jpeg_destroy_compress(&cinfo);
 	jpeg_destroy_decompress(&dinfo);
 
+	stats.status = res;
+	if (result)
+		*result = stats;
+
 	return res;
 }
 
 
-#ifdef PARALLEL_PROCESSING
-int wait_for_worker(FILE *log_fh)
+uint64_t options_hash(const char *dest_path)
 {
-	FILE *p;
-	struct worker *w;
-	char buf[1024];
-	int wstatus;
-	pid_t pid;
-	int j, e;
-	int state = 0;
-	double val;
-	double rate = 0.0;
-	double saved = 0.0;
-
-
-	if ((pid = wait(&wstatus)) < 0)
-		return pid;
-
-	w = NULL;
-	for (j = 0; j < MAX_WORKERS; j++) {
-		if (workers[j].pid == pid) {
-			w = &workers[j];
-			break;
-		}
-	}
-	if (!w)
-		fatal("Unknown worker[%d] process found\n", pid);
+	char buf[MAXPATHLEN + 256];
+#ifdef HAVE_ARITH_CODE
+	int arith = arith_mode;
+#else
+	int arith = -1;
+#endif
 
-	if (WIFEXITED(wstatus)) {
-		e = WEXITSTATUS(wstatus);
-		if (verbose_mode)
-			fprintf(log_fh, "worker[%d] [slot=%d] exited: %d\n",
-				pid, j, e);
-		if (e == 0) {
-			//average_count++;
-			//average_rate += rate;
-			//total_save += saved;
-		} else if (e == 1) {
-			decompress_err_count++;
-		} else if (e == 2) {
-			compress_err_count++;
-		}
-	} else {
-		fatal("worker[%d] killed", pid);
-	}
+	/* Options that affect the output (if any of these change, files need to be processed again) */
+	snprintf(buf, sizeof(buf), "%s q%d S%d T%0.2f f%d r%d x%d n%d p%d a%d A%d "
+		"m%d%d%d%d%d%d%d%d%d%d d%s",
+		VERSION, quality, target_size, threshold, force, retry_mode, save_extra,
+		all_normal, all_progressive, auto_mode, arith,
+		save_exif, save_iptc, save_com, save_icc, save_xmp, save_adobe,
+		save_jfxx, save_jfif, strip_none, nofix_mode,
+		(dest ? dest_path : ""));
 
-	p = fdopen(w->read_pipe, "r");
-	if (!p) fatal("fdopen failed()");
-	while (fgets(buf, sizeof(buf), p)) {
-		if (verbose_mode > 2)
-			fprintf(log_fh, "worker[%d] PIPE: %s", pid, buf);
-		if (state == 0 && buf[0] == '\n') {
-			state=1;
-			continue;
-		}
-		if (state == 1 && !strncmp(buf, "STAT", 4)) {
-			state=2;
-			continue;
-		}
-		if (state >= 2) {
-			if (sscanf(buf, "%lf", &val) == 1) {
-				if (state == 2) {
-					rate = val;
-				}
-				else if (state == 3) {
-					saved = val;
-					average_count++;
-					average_rate += rate;
-					total_save += saved;
-				}
-			}
-			state++;
-			continue;
-		}
-		if (state == 0)
-			fprintf(log_fh, "%s", buf);
+	return content_hash(0, buf, strlen(buf));
+}
+
+
+void print_processed(FILE *log_fh, const char *filename, const struct stat *st,
+		const char *reason)
+{
+	char line[MAXPATHLEN + 128];
+
+	/* Report file that was skipped without processing it */
+	if (csv)
+		snprintf(line, sizeof(line), "%s,,,,%ld,%ld,0.00,skipped\n",
+			filename, (long)st->st_size, (long)st->st_size);
+	else if (!quiet_mode)
+		snprintf(line, sizeof(line), "%s [%s] %ld --> %ld bytes (0.00%%), skipped.\n",
+			filename, reason, (long)st->st_size, (long)st->st_size);
+	else
+		return;
+
+#ifdef PARALLEL_PROCESSING
+	/* Keep output in order with results from workers (--ordered) */
+	if (max_workers > 1) {
+		dispatch_output(log_fh, line);
+		return;
 	}
-	close(w->read_pipe);
-	w->pid = -1;
-	w->read_pipe = -1;
-	worker_count --;
+#endif
+	fputs(line, log_fh);
+}
+
 
-	return pid;
+void update_totals(const char *filename, const char *newname,
+		const struct job_result *r)
+{
+	if (manifest_file && filename) {
+		/* Record state of the file after processing it */
+		if (r->status == 0 && r->size >= 0)
+			manifest_add(filename, r->size, r->mtime,
+				(r->optimized ? MANIFEST_OPTIMIZED : MANIFEST_SKIPPED));
+		else
+			manifest_add(filename, -1, 0, MANIFEST_ERROR);
+	}
+	if (journal_file && filename)
+		totals.sync_time += journal_add(filename, newname, r->status);
+
+	if (r->status == 0 && r->cached) {
+		cached_count++;
+	} else if (r->status == 0) {
+		average_count++;
+		average_rate += r->rate;
+		total_save += r->saved;
+		totals.insize += r->insize;
+		totals.outsize += r->outsize;
+		totals.trials += r->trials;
+		totals.decode_time += r->decode_time;
+		totals.encode_time += r->encode_time;
+		totals.write_time += r->write_time;
+		totals.sync_time += r->sync_time;
+		totals.dedup += r->dedup;
+	} else if (r->status == 1) {
+		decompress_err_count++;
+	} else if (r->status == 2) {
+		compress_err_count++;
+	} else {
+		worker_err_count++;
+	}
 }
-#endif
 
 
 #ifndef BUILD_FOR_OSS_FUZZ // Libfuzzer provides its own fuzzer
@@ -1349,26 +1895,12 @@ int main(int argc, char **argv)
 	struct stat file_stat;
 	char tmpfilename[MAXPATHLEN + 1],tmpdir[MAXPATHLEN + 1];
 	char newname[MAXPATHLEN + 1], dest_path[MAXPATHLEN + 1];
-	char namebuf[MAXPATHLEN + 2];
+	struct file_entry *entry;
 	const char *filename;
 	int arg_idx;
 	int res;
-	double rate, saved;
+	struct job_result result;
 	FILE *log_fh;
-#ifdef PARALLEL_PROCESSING
-	struct worker *w;
-	int pipe_fd[2];
-	pid_t pid;
-
-
-	/* Allocate table to keep track of child processes... */
-	if (!(workers = calloc(MAX_WORKERS, sizeof(struct worker))))
-		fatal("not enough memory");
-	for (int i = 0; i < MAX_WORKERS; i++) {
-		workers[i].pid = -1;
-		workers[i].read_pipe = -1;
-	}
-#endif
 
 	umask(077);
 	signal(SIGINT,own_signal_handler);
@@ -1379,6 +1911,52 @@ int main(int argc, char **argv)
 	log_fh = (stdout_mode ? stderr : stdout);
 	if (quiet_mode)
 		verbose_mode = 0;
+	if (prefetch_depth < 0)
+		prefetch_depth = (io_uring_mode ? PREFETCH_DEFAULT : 0);
+	if (skip_stamped)
+		stamp_mode = 1;
+	settings_hash = options_hash(dest_path);
+	if (cache_file && !stdin_mode) {
+		if (cache_open(cache_file, settings_hash) < 0)
+			fatal("cannot open cache file: %s", cache_file);
+	}
+	if (journal_file && !stdin_mode && !noaction) {
+		int count = journal_open(journal_file, settings_hash, resume_mode);
+
+		if (count == -2)
+			fatal("journal file already exists (use --resume to continue): %s",
+				journal_file);
+		if (count == -3)
+			fatal("journal file was created using different options: %s",
+				journal_file);
+		if (count == -4)
+			fatal("not a journal file: %s", journal_file);
+		if (count < 0)
+			fatal("cannot open journal file: %s", journal_file);
+		if (resume_mode && verbose_mode)
+			fprintf(log_fh, "Resuming, %d files completed earlier (journal): %s\n",
+				count, journal_file);
+	}
+	if (manifest_file && !stdin_mode) {
+		int count = manifest_load(manifest_file, settings_hash);
+
+		if (count < 0)
+			fatal("failed to read manifest file: %s", manifest_file);
+		if (verbose_mode)
+			fprintf(log_fh, "Loaded %d entries from manifest: %s\n",
+				count, manifest_file);
+	}
+
+#ifdef DEDUP_SUPPORT
+	if (dedup_mode && dedup_init(dedup_size) < 0) {
+		warn("failed to allocate shared memory, disabling --dedup");
+		dedup_mode = 0;
+	}
+#endif
+#ifdef PARALLEL_PROCESSING
+	if (max_workers > 1)
+		init_workers();
+#endif
 
 	if (verbose_mode) {
 		if (quality >= 0 && target_size == 0)
@@ -1399,12 +1977,29 @@ int main(int argc, char **argv)
 		if (max_workers > 0)
 			fprintf(log_fh, "Using maximum of %d parallel threads\n", max_workers);
 #endif
+		if (prefetch_depth > 0)
+			fprintf(log_fh, "Reading ahead %d input files\n", prefetch_depth);
+		if (nocache_mode)
+			fprintf(log_fh, "Dropping processed files from page cache\n");
+		if (file_order != ORDER_INPUT)
+			fprintf(log_fh, "Processing files in order: %s\n",
+				file_order_names[file_order]);
+#ifdef HAVE_IO_URING
+		if (io_uring_mode)
+			fprintf(log_fh, "Using io_uring for file I/O\n");
+#endif
+		if (fsync_mode == FSYNC_BATCH)
+			fprintf(log_fh, "Syncing output files every %d files or %d ms\n",
+				fsync_batch_files, fsync_batch_time);
+		else if (fsync_mode != FSYNC_NONE)
+			fprintf(log_fh, "Syncing output files: %s\n",
+				fsync_mode_names[fsync_mode]);
 	}
 
 
 	if (stdin_mode) {
 		/* Process just one file, if source is stdin... */
-		res = optimize(stderr, NULL, NULL, NULL, &file_stat, NULL, NULL);
+		res = optimize(stderr, NULL, NULL, NULL, &file_stat, NULL);
 		return (res == 0 ? 0 : 1);
 	}
 
@@ -1417,15 +2012,14 @@ int main(int argc, char **argv)
 	}
 
 
+	init_file_list(argc, argv, arg_idx, files_from, file_order);
+	prefetch_init();
+
 	/* Main loop to process input files */
-	do {
-		if (files_from) {
-			if (!fgetstr(namebuf, sizeof(namebuf), files_from))
-				break;
-			filename = namebuf;
-		} else {
-			filename = argv[arg_idx];
-		}
+	while ((entry = next_file())) {
+		filename = entry->name;
+		/* Start reading upcoming files, while this one is being processed */
+		prefetch_files(prefetch_depth);
 
 		if (*filename == 0)
 			continue;
@@ -1451,107 +2045,114 @@ int main(int argc, char **argv)
 			}
 		}
 
-		if (file_exists(filename)) {
-			if (!is_file(filename, &file_stat)) {
-				if (is_directory(filename))
-					warn("skipping directory: %s", filename);
-				else
-					warn("skipping special file: %s", filename);
-				continue;
-			}
-		} else {
-			warn("file not found: %s", filename);
+		if (!entry->regular) {
+			if (!file_exists(filename))
+				warn("file not found: %s", filename);
+			else if (is_directory(filename))
+				warn("skipping directory: %s", filename);
+			else
+				warn("skipping special file: %s", filename);
+			continue;
+		}
+		file_stat = entry->st;
+
+		if (resume_mode && journal_lookup(filename)) {
+			/* File was completed before the previous run was interrupted */
+			print_processed(log_fh, filename, &file_stat, "resumed");
+			resumed_count++;
+			continue;
+		}
+		if (manifest_file && manifest_lookup(filename, &file_stat)) {
+			/* File has not changed since the last run */
+			print_processed(log_fh, filename, &file_stat, "unchanged");
+			unchanged_count++;
+			continue;
+		}
+		if (skip_stamped && read_stamp(filename, settings_hash, file_stat.st_size)) {
+			/* File is marked as already processed (with current options) */
+			print_processed(log_fh, filename, &file_stat, "stamped");
+			stamped_count++;
+			continue;
+		}
+		if (cache_file && cache_lookup(&file_stat)) {
+			/* File has not changed since it was processed last time */
+			print_processed(log_fh, filename, &file_stat, "cached");
+			cached_count++;
 			continue;
 		}
 
 #ifdef PARALLEL_PROCESSING
 		if (max_workers > 1) {
-			/* Multi process mode, run up to max_workers processes simultaneously... */
-
-			if (worker_count >= max_workers) {
-				// wait for a worker to exit...
-				wait_for_worker(log_fh);
-			}
-			if (pipe(pipe_fd) < 0)
-				fatal("failed to open pipe");
-			pid = fork();
-			if (pid < 0)
-				fatal("fork() failed");
-			if (pid == 0) {
-				/* Child process starts here... */
-				if (files_from)
-					fclose(files_from);
-				close(pipe_fd[0]);
-				FILE *p;
-
-				if (!(p = fdopen(pipe_fd[1],"w")))
-					fatal("worker: fdopen failed");
-
-				res = optimize(p, filename, newname, tmpdir, &file_stat, &rate, &saved);
-				if (res == 0)
-					fprintf(p, "\n\nSTATS\n%lf\n%lf\n", rate, saved);
-				exit(res);
-			} else {
-				/* Parent continues here... */
-				int j;
-
-				close(pipe_fd[1]);
-
-				w = NULL;
-				for (j = 0; j < MAX_WORKERS; j++) {
-					if (workers[j].pid < 0) {
-						w = &workers[j];
-						break;
-					}
-				}
-				if (!w)
-					fatal("no space to start a new worker (%d)", worker_count);
-				w->pid = pid;
-				w->read_pipe = pipe_fd[0];
-				worker_count++;
-				if (verbose_mode > 0)
-					fprintf(log_fh, "worker[%d] [slot=%d] started\n", pid, j);;
-			}
-
+			/* Multi process mode, pass file to the next available worker process... */
+			dispatch_job(log_fh, filename, newname, tmpdir, &file_stat);
 		} else
 #endif
 		{
 			/* Single process mode, process one file at a time... */
 
-			res = optimize(log_fh, filename, newname, tmpdir, &file_stat, &rate, &saved);
-			if (res == 0) {
-				average_count++;
-				average_rate += rate;
-				total_save += saved;
-			} else if (res == 1) {
-				decompress_err_count++;
-			} else if (res == 2) {
-				compress_err_count++;
-			}
+			optimize(log_fh, filename, newname, tmpdir, &file_stat, &result);
+			update_totals(filename, newname, &result);
 		}
 
-	} while (files_from || ++arg_idx < argc);
+	}
+	free_file_list();
 
 
 #ifdef PARALLEL_PROCESSING
-	/* Wait for any child processes to exit... */
-	if (max_workers > 1) {
-		if (verbose_mode) {
-			fprintf(log_fh, "Waiting for %d workers to finish...\n", worker_count);
-		}
-		while ((pid = wait_for_worker(log_fh)) > 0) {
-			if (verbose_mode > 2)
-				fprintf(log_fh, "worker[%d] done\n", pid);
-		}
+	/* Wait for any workers to finish... */
+	if (max_workers > 1)
+		stop_workers(log_fh);
+#endif
+	prefetch_exit();
+	cache_close();
+	if (manifest_file && !noaction) {
+		if (manifest_save(manifest_file) != 0)
+			warn("failed to save manifest file: %s", manifest_file);
+		manifest_free();
 	}
+#ifdef DEDUP_SUPPORT
+	dedup_exit();
+#endif
+#ifdef HAVE_IO_URING
+	if (io_uring_mode)
+		uring_release();
 #endif
+	totals.sync_time += sync_flush();
+	/* Close journal only after output files have been synced */
+	totals.sync_time += journal_close(decompress_err_count == 0 && compress_err_count == 0 &&
+					worker_err_count == 0);
 
-	if (totals_mode && !quiet_mode)
+	if (totals_mode && !quiet_mode) {
 		fprintf(log_fh, "Average ""compression"" (%ld files): %0.2f%% (total saved %0.0fk)\n",
-			average_count, average_rate/average_count, total_save);
+			average_count, (average_count > 0 ? average_rate/average_count : 0.0),
+			total_save);
+		if (verbose_mode)
+			fprintf(log_fh, "Processing time: decompress %0.2fs, compress %0.2fs "
+				"(%d passes), write %0.2fs, sync %0.2fs\n",
+				totals.decode_time, totals.encode_time, totals.trials,
+				totals.write_time, totals.sync_time);
+		if (cached_count > 0)
+			fprintf(log_fh, "Skipped %ld files already processed earlier (cache)\n",
+				cached_count);
+#ifdef DEDUP_SUPPORT
+		if (dedup_mode)
+			fprintf(log_fh, "Reused results for %d duplicate files (encodes avoided)\n",
+				totals.dedup);
+#endif
+		if (stamped_count > 0)
+			fprintf(log_fh, "Skipped %ld files already processed earlier (stamped)\n",
+				stamped_count);
+		if (resumed_count > 0)
+			fprintf(log_fh, "Skipped %ld files completed earlier (journal)\n",
+				resumed_count);
+		if (unchanged_count > 0)
+			fprintf(log_fh, "Skipped %ld unchanged files (manifest)\n",
+				unchanged_count);
+	}
 
 
-	return (decompress_err_count > 0 || compress_err_count > 0 ? 1 : 0);;
+	return (decompress_err_count > 0 || compress_err_count > 0 ||
+		worker_err_count > 0 ? 1 : 0);
 }
 #else
 void fuzz_set_target_size(const int new_target_size)
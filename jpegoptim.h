@@ -39,8 +39,12 @@ extern "C" {
 #define DIR_SEPARATOR_S "/"
 #define set_filemode_binary(file) {}
 #endif
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 #include <jpeglib.h>
 
 #ifdef BROKEN_METHODDEF
@@ -58,21 +62,172 @@ extern "C" {
 
 #define PROGRAMNAME "jpegoptim"
 
+#if HAVE_WAIT && HAVE_FORK
+#define WORKER_PROCESSES 1
+#endif
+#if HAVE_PTHREAD && !defined(WIN32)
+#define WORKER_THREADS 1
+#endif
+#if defined(WORKER_PROCESSES) || defined(WORKER_THREADS)
+#define PARALLEL_PROCESSING 1
+#define MAX_WORKERS 256
+#endif
+#define CPU_LIST_SIZE 1024
+#if defined(HAVE_MMAP) && defined(WORKER_THREADS)
+#define DEDUP_SUPPORT 1
+#define DEDUP_SIZE (256 * 1024 * 1024)	/* default size of the --dedup table */
+#endif
+#define LOOKAHEAD_MAX 64	/* max number of files to look ahead in file list */
+#define STAMP_XATTR "user.jpegoptim"	/* extended attribute for --stamp */
+#define DIRECT_IO_ALIGN 4096	/* buffer/size alignment for O_DIRECT reads */
+#define PREFETCH_DEFAULT 8	/* files to read ahead with --io-uring (unless set with --prefetch) */
+#ifdef HAVE_IO_URING
+#define URING_IOV_MAX 1024
+#endif
+
 
 extern int verbose_mode;
 extern int quiet_mode;
+extern int max_workers;
+extern int thread_mode;
+extern FILE *files_from;
+extern long long max_memory;
+extern int ordered_output;
+extern int adaptive_mode;
+extern int pin_mode;
+extern int read_mode;
+extern char *pin_cpus;
+extern int io_uring_mode;
+extern int prefetch_depth;
+extern int fsync_mode;
+extern int fsync_batch_files;
+extern int fsync_batch_time;
+
+
+/* Input file read modes (--read-mode) */
+#define READ_MMAP   0
+#define READ_STREAM 1
+#define READ_WHOLE  2
+
+/* Input file order (--order) */
+#define ORDER_INPUT    0
+#define ORDER_LARGEST  1
+#define ORDER_SMALLEST 2
+#define ORDER_NEWEST   3
+
+/* Result of processing a file, saved for identical files (--dedup) */
+struct dedup_info {
+	long   in_image_size;
+	int    error_counter;
+	int    quality;
+	int    progressive;
+	int    arith;
+	size_t outlen;		/* size of the output image */
+};
+
+/* SHA-256 message digest */
+#define SHA256_SIZE 32
+
+struct sha256_ctx {
+	uint32_t state[8];
+	uint64_t count;
+	unsigned char buf[64];
+};
+
+/* Results stored in the cache file (--cache) */
+#define CACHE_OPTIMIZED 1
+#define CACHE_SKIPPED   2
+
+/* Results stored in the manifest file (--manifest) */
+#define MANIFEST_OPTIMIZED 1
+#define MANIFEST_SKIPPED   2
+#define MANIFEST_ERROR     3
+
+/* Output file durability (--fsync) */
+#define FSYNC_NONE  0
+#define FSYNC_FILE  1
+#define FSYNC_BATCH 2
+
+/* Buffer consisting of fixed size segments (for output images) */
+#define SEG_SIZE (64 * 1024)
+
+struct seg_buffer {
+	unsigned char **seg;
+	size_t count;		/* number of segments */
+	size_t size;		/* size of seg array */
+	size_t used;		/* bytes of data in the buffer */
+};
+
+/* Input file to process */
+struct file_entry {
+	char *name;
+	struct stat st;
+	int  regular;		/* name is a regular file (and st is valid) */
+	long seq;		/* position in the input */
+};
+
+/* Result of processing a single file */
+struct job_result {
+	int    status;		/* 0 = OK, 1 = decompress error, 2 = compress error, 3 = worker failed */
+	int    optimized;	/* output file was written (or would have been) */
+	long   insize;
+	long   outsize;
+	double rate;		/* compression ratio (%) */
+	double saved;		/* bytes saved (kB) */
+	int    trials;		/* number of compression passes */
+	int    quality;		/* quality setting of the output (-1 = lossless) */
+	int    progressive;	/* output was progressive */
+	int    arith;		/* output used arithmetic coding */
+	double decode_time;	/* time spent reading and decompressing input (seconds) */
+	double encode_time;	/* time spent compressing */
+	double write_time;	/* time spent saving output */
+	double sync_time;	/* time spent waiting for output to be synced to disk */
+	int    dedup;		/* result was reused from an identical file */
+	int    cached;		/* file was skipped, as identical file was processed earlier (--cache) */
+	long long size;		/* size of the file after processing (-1 = unknown) */
+	int64_t mtime;		/* modification time (ns) of the file after processing */
+};
+
+
+/* jpegoptim.c */
+int optimize(FILE *log_fh, const char *filename, const char *newname,
+	const char *tmpdir, struct stat *file_stat,
+	struct job_result *result);
+long long estimate_memory(const char *filename, const struct stat *file_stat);
+void update_totals(const char *filename, const char *newname,
+		const struct job_result *r);
 
 
 /* misc.c */
 FILE* create_file(const char *name);
 FILE *create_temp_file(const char *tmpdir, const char *name, char *filename, size_t filename_len);
+#ifdef HAVE_O_TMPFILE
+FILE *create_unnamed_file(const char *tmpdir);
+char *unnamed_file_path(int fd, char *buf, size_t size);
+char *unnamed_link_name(int fd, const char *tmpdir, char *buf, size_t size);
+int link_file(int fd, const char *tmpdir, const char *newname, int replace);
+#endif
 int delete_file(const char *name);
 long file_size(FILE *fp);
+void *map_file(FILE *fp, size_t *size);
+void unmap_file(void *buf, size_t size);
+void *read_file_direct(const char *filename, size_t size, size_t *bufsize, size_t *used);
+void drop_file_cache(int fd, int written);
+int read_stamp(const char *filename, uint64_t options, long long size);
+int write_stamp(const char *filename, const char *version, uint64_t options, long long size);
+int64_t file_mtime(const struct stat *st);
 int is_directory(const char *path);
 int is_file(const char *filename, struct stat *st);
 int file_exists(const char *pathname);
 int rename_file(const char *old_path, const char *new_path);
 int copy_file(const char *srcname, const char *dstname);
+size_t readn(int fd, void *buf, size_t size);
+size_t writen(int fd, const void *buf, size_t size);
+#ifdef HAVE_SYS_UIO_H
+size_t writevn(int fd, struct iovec *iov, int iovcnt);
+#endif
+double get_time(void);
+long long parse_size(const char *s);
 char *fgetstr(char *s, size_t size, FILE *stream);
 char *splitdir(const char *pathname, char *buf, size_t size);
 char *splitname(const char *pathname, char *buf, size_t size);
@@ -86,18 +241,112 @@ void warn(const char *format, ...);
 /* jpegdest.c */
 void jpeg_memory_dest (j_compress_ptr cinfo, unsigned char **bufptr,
 		size_t *bufsizeptr, size_t incsize);
+void jpeg_segment_dest (j_compress_ptr cinfo, struct seg_buffer *buf);
+void seg_buffer_free(struct seg_buffer *b);
+void seg_buffer_swap(struct seg_buffer *a, struct seg_buffer *b);
+size_t seg_buffer_write(int fd, const struct seg_buffer *b, const void *extra, size_t extralen);
+void seg_buffer_load(struct seg_buffer *b, const void *data, size_t len);
+void seg_buffer_digest(const struct seg_buffer *b, const void *extra, size_t extralen,
+		unsigned char *digest);
+#ifdef HAVE_SYS_UIO_H
+int seg_buffer_iov(const struct seg_buffer *b, const void *extra, size_t extralen,
+		struct iovec *iov, int max);
+#endif
 
 /* jpegsrc.c */
 void jpeg_custom_src(j_decompress_ptr dinfo, FILE *infile,
 		unsigned char **bufptr,	size_t *bufsizeptr, size_t *bufusedptr, size_t incsize);
 void jpeg_custom_mem_src(j_decompress_ptr dinfo, unsigned char *buf, size_t bufsize);
+void jpeg_segment_src(j_decompress_ptr dinfo, const struct seg_buffer *buf);
 
-#ifdef BUILD_FOR_OSS_FUZZ
-// Forward declare the main function to allow access from the harness
-int optimize(FILE *log_fh, const char *filename, const char *newname,
-	const char *tmpdir, struct stat *file_stat,
-	double *rate, double *saved);
+/* filelist.c */
+extern const char *file_order_names[];
+int parse_file_order(const char *s);
+void init_file_list(int argc, char **argv, int arg_idx, FILE *files_from, int order);
+struct file_entry* next_file(void);
+struct file_entry* peek_file(int n);
+void free_file_list(void);
+
+/* cache.c */
+uint64_t content_hash(uint64_t h, const void *buf, size_t len);
+int content_digest_file(const char *filename, unsigned char *digest);
+int cache_open(const char *filename, uint64_t options);
+int cache_lookup(const struct stat *st);
+int cache_lookup_content(const struct stat *st, const unsigned char *digest);
+void cache_store(const struct stat *st, const unsigned char *digest, int result);
+void cache_close(void);
+
+/* sha256.c */
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, unsigned char *digest);
+
+/* manifest.c */
+int manifest_load(const char *filename, uint64_t options);
+int manifest_lookup(const char *path, const struct stat *st);
+void manifest_add(const char *path, long long size, int64_t mtime, int result);
+int manifest_save(const char *filename);
+void manifest_free(void);
 
+/* journal.c */
+int journal_open(const char *filename, uint64_t options, int resume);
+int journal_lookup(const char *path);
+double journal_add(const char *path, const char *newname, int status);
+double journal_close(int complete);
+
+/* dedup.c */
+#ifdef DEDUP_SUPPORT
+int dedup_init(size_t size);
+int dedup_lookup(uint64_t hash, const void *in, size_t insize, struct dedup_info *info,
+		struct seg_buffer *out);
+void dedup_store(uint64_t hash, const void *in, size_t insize,
+		const struct dedup_info *info, const struct seg_buffer *out);
+void dedup_exit(void);
+#endif
+
+/* fsync.c */
+extern const char *fsync_mode_names[];
+int parse_fsync_mode(const char *s, int *batch_files, int *batch_time);
+double sync_file(int fd);
+double sync_commit(FILE *log_fh, const char *newname);
+void sync_register(const char *newname);
+double sync_flush(void);
+
+/* prefetch.c */
+void prefetch_init(void);
+void prefetch_files(int depth);
+void prefetch_exit(void);
+
+/* sysinfo.c */
+int available_cpus(void);
+int parse_workers(const char *s);
+int read_pressure(const char *resource, unsigned long long *total);
+double load_average(void);
+int parse_cpu_list(const char *s, int *cpus, int max);
+int cpu_placement(const char *cpulist, int *cpus, int max);
+int set_cpu_affinity(int cpu);
+
+/* uring.c */
+#ifdef HAVE_IO_URING
+int uring_write_rename(int fd, struct iovec *iov, int iovcnt, size_t len,
+		const struct timespec *mtime, int do_fsync, const char *linkpath,
+		const char *oldpath, const char *newpath);
+void uring_release(void);
+int uring_prefetch_init(void);
+void uring_prefetch(int depth);
+void uring_prefetch_exit(void);
+#endif
+
+/* worker.c */
+#ifdef PARALLEL_PROCESSING
+void init_workers(void);
+void dispatch_job(FILE *log_fh, const char *filename, const char *newname,
+		const char *tmpdir, struct stat *file_stat);
+void dispatch_output(FILE *log_fh, const char *text);
+void stop_workers(FILE *log_fh);
+#endif
+
+#ifdef BUILD_FOR_OSS_FUZZ
 /**
  * Fuzzing utility function to set the target size global value
  * @param new_target_size: The value to override the target size with
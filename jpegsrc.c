@@ -52,6 +52,9 @@ typedef struct {
 	FILE *infile;
 	JOCTET *stdio_buffer;
 	boolean start_of_file;
+
+	const struct seg_buffer *segbuf;
+	size_t segnext;
 } jpeg_custom_source_mgr;
 
 typedef jpeg_custom_source_mgr* jpeg_custom_source_mgr_ptr;
@@ -129,6 +132,31 @@ static boolean custom_fill_mem_input_buffer (j_decompress_ptr dinfo)
 }
 
 
+static void custom_init_seg_source (j_decompress_ptr dinfo)
+{
+	jpeg_custom_source_mgr_ptr src = (jpeg_custom_source_mgr_ptr) dinfo->src;
+
+	src->segnext = 0;
+}
+
+
+static boolean custom_fill_seg_input_buffer (j_decompress_ptr dinfo)
+{
+	jpeg_custom_source_mgr_ptr src = (jpeg_custom_source_mgr_ptr) dinfo->src;
+	const struct seg_buffer *b = src->segbuf;
+	size_t offset = src->segnext * SEG_SIZE;
+
+	if (offset >= b->used)
+		return custom_fill_mem_input_buffer(dinfo);
+
+	/* Pass next segment of the buffer to the decoder... */
+	src->pub.next_input_byte = b->seg[src->segnext++];
+	src->pub.bytes_in_buffer = (b->used - offset < SEG_SIZE ? b->used - offset : SEG_SIZE);
+
+	return TRUE;
+}
+
+
 static void custom_skip_input_data (j_decompress_ptr dinfo, long num_bytes)
 {
 	jpeg_custom_source_mgr_ptr src = (jpeg_custom_source_mgr_ptr) dinfo->src;
@@ -227,4 +255,18 @@ void jpeg_custom_mem_src(j_decompress_ptr dinfo, unsigned char *buf, size_t bufs
 }
 
 
+void jpeg_segment_src(j_decompress_ptr dinfo, const struct seg_buffer *buf)
+{
+	jpeg_custom_source_mgr_ptr src;
+
+	jpeg_custom_mem_src(dinfo, NULL, 0);
+	src = (jpeg_custom_source_mgr_ptr) dinfo->src;
+
+	src->pub.init_source = custom_init_seg_source;
+	src->pub.fill_input_buffer = custom_fill_seg_input_buffer;
+	src->segbuf = buf;
+	src->segnext = 0;
+}
+
+
 /* eof :-) */
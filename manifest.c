@@ -0,0 +1,283 @@
+/* manifest.c
+ *
+ * Copyright (C) 2025 Timo Kokkonen
+ * All Rights Reserved.
+ *
+ * Manifest of processed files (--manifest), to only process files that
+ * have changed since the last run.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of JPEGoptim.
+ *
+ * JPEGoptim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JPEGoptim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JPEGoptim. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "jpegoptim.h"
+
+#define MANIFEST_MAGIC "JOMANIF1"
+
+
+/*
+ * Manifest file: header (magic, hash of options, number of entries),
+ * followed by variable length entries (fixed part + path).
+ */
+struct manifest_header {
+	char     magic[8];
+	uint64_t options;
+	uint64_t count;
+};
+
+struct manifest_entry {
+	int64_t  size;
+	int64_t  mtime;		/* modification time (ns) */
+	uint16_t result;	/* MANIFEST_OPTIMIZED, MANIFEST_SKIPPED, ... */
+	uint16_t pathlen;
+	char     path[];
+};
+
+
+static char *old_data = NULL;		/* manifest loaded at start */
+static size_t old_size = 0;
+static struct manifest_entry **entries = NULL;	/* old and new entries */
+static size_t entry_count = 0;
+static size_t entry_size = 0;
+static size_t *index_table = NULL;	/* hash table of entry numbers (+1) */
+static size_t index_size = 0;
+static uint64_t manifest_options = 0;
+
+
+
+static size_t path_slot(const char *path, size_t len)
+{
+	return (size_t)content_hash(0, path, len) & (index_size - 1);
+}
+
+
+static size_t *find_slot(const char *path, size_t len)
+{
+	size_t i = path_slot(path, len);
+
+	/* Returns slot with the matching entry, or the (empty) slot where it should go */
+	while (index_table[i]) {
+		struct manifest_entry *e = entries[index_table[i] - 1];
+		if (e->pathlen == len && !memcmp(e->path, path, len))
+			break;
+		i = (i + 1) & (index_size - 1);
+	}
+
+	return &index_table[i];
+}
+
+
+static void add_entry(struct manifest_entry *e)
+{
+	size_t *slot;
+
+	if (entry_count >= entry_size) {
+		size_t newsize = (entry_size > 0 ? entry_size * 2 : 1024);
+		void *p;
+
+		if (!(p = realloc(entries, newsize * sizeof(struct manifest_entry *))))
+			fatal("not enough memory");
+		entries = p;
+		entry_size = newsize;
+	}
+	if (entry_count * 2 >= index_size) {
+		/* Grow hash table (keep it at most half full), and rebuild it */
+		free(index_table);
+		index_size = (index_size > 0 ? index_size * 2 : 2048);
+		if (!(index_table = calloc(index_size, sizeof(size_t))))
+			fatal("not enough memory");
+		for (size_t i = 0; i < entry_count; i++) {
+			if (entries[i])
+				*find_slot(entries[i]->path, entries[i]->pathlen) = i + 1;
+		}
+	}
+
+	/* Newer entry for the same path replaces the old one */
+	slot = find_slot(e->path, e->pathlen);
+	if (*slot) {
+		struct manifest_entry *old = entries[*slot - 1];
+		if ((char*)old < old_data || (char*)old >= old_data + old_size)
+			free(old);
+		entries[*slot - 1] = NULL;
+	}
+	entries[entry_count++] = e;
+	*slot = entry_count;
+}
+
+
+int manifest_load(const char *filename, uint64_t options)
+{
+	struct manifest_header hdr;
+	FILE *fp;
+	long size;
+	size_t pos;
+
+	manifest_options = options;
+	if (!(fp = fopen(filename, "rb")))
+		return 0;
+
+	/* Read whole manifest into memory (entries point directly to it) */
+	if ((size = file_size(fp)) < (long)sizeof(hdr) ||
+		fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+		memcmp(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic)) ||
+		hdr.options != options) {
+		/* Ignore manifest from a different version, or with different options */
+		fclose(fp);
+		return 0;
+	}
+	old_size = size - sizeof(hdr);
+	if (!(old_data = malloc(old_size + 1)))
+		fatal("not enough memory");
+	if (fread(old_data, 1, old_size, fp) != old_size) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	for (pos = 0; pos + sizeof(struct manifest_entry) <= old_size; ) {
+		struct manifest_entry *e = (struct manifest_entry*)(old_data + pos);
+		size_t len = sizeof(struct manifest_entry) + e->pathlen;
+
+		len = (len + 7) & ~(size_t)7;
+		if (pos + len > old_size)
+			break;
+		add_entry(e);
+		pos += len;
+	}
+
+	return entry_count;
+}
+
+
+int manifest_lookup(const char *path, const struct stat *st)
+{
+	struct manifest_entry *e;
+	size_t *slot;
+
+	if (index_size < 1)
+		return 0;
+
+	/* Skip file if it has been processed without errors, and not changed since */
+	slot = find_slot(path, strlen(path));
+	if (!*slot || !(e = entries[*slot - 1]))
+		return 0;
+	if (e->result != MANIFEST_OPTIMIZED && e->result != MANIFEST_SKIPPED)
+		return 0;
+
+	return (e->size == st->st_size && e->mtime == file_mtime(st) ? 1 : 0);
+}
+
+
+void manifest_add(const char *path, long long size, int64_t mtime, int result)
+{
+	struct manifest_entry *e;
+	size_t len = strlen(path);
+
+	if (len > UINT16_MAX)
+		return;
+	if (!(e = calloc(1, sizeof(struct manifest_entry) + len + 8)))
+		fatal("not enough memory");
+	e->size = size;
+	e->mtime = mtime;
+	e->result = result;
+	e->pathlen = len;
+	memcpy(e->path, path, len);
+	add_entry(e);
+}
+
+
+int manifest_save(const char *filename)
+{
+	char tmpname[MAXPATHLEN + 1];
+	struct manifest_header hdr;
+	static const char pad[8] = { 0 };
+	FILE *fp;
+	int err = 0;
+	int len;
+
+	/* Write new manifest to a temp file first, and then replace old manifest with it */
+	len = snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+	if (len < 0 || (size_t)len >= sizeof(tmpname))
+		return -1;
+	if (!(fp = fopen(tmpname, "wb")))
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+	hdr.options = manifest_options;
+	for (size_t i = 0; i < entry_count; i++) {
+		if (entries[i])
+			hdr.count++;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		err = 1;
+	for (size_t i = 0; i < entry_count && !err; i++) {
+		struct manifest_entry *e = entries[i];
+		size_t len;
+
+		if (!e)
+			continue;
+		len = sizeof(struct manifest_entry) + e->pathlen;
+		if (fwrite(e, len, 1, fp) != 1)
+			err = 1;
+		/* keep entries aligned */
+		if (len & 7 && fwrite(pad, 8 - (len & 7), 1, fp) != 1)
+			err = 1;
+	}
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+		err = 1;
+	if (fclose(fp) != 0)
+		err = 1;
+
+	if (err || rename_file(tmpname, filename)) {
+		delete_file(tmpname);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+void manifest_free(void)
+{
+	for (size_t i = 0; i < entry_count; i++) {
+		char *e = (char*)entries[i];
+		if (e && (e < old_data || e >= old_data + old_size))
+			free(e);
+	}
+	free(entries);
+	free(index_table);
+	free(old_data);
+	entries = NULL;
+	index_table = NULL;
+	old_data = NULL;
+	entry_count = entry_size = index_size = old_size = 0;
+}
+
+
+/* eof :-) */
@@ -21,6 +21,9 @@
  * along with JPEGoptim. If not, see <https://www.gnu.org/licenses/>.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -32,9 +35,21 @@
 #include <unistd.h>
 #endif
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <time.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
+#ifdef HAVE_FICLONE
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 
 #include "jpegoptim.h"
@@ -98,6 +113,84 @@ FILE *create_temp_file(const char *tmpdir, const char *name, char *filename, siz
 }
 
 
+#ifdef HAVE_O_TMPFILE
+FILE *create_unnamed_file(const char *tmpdir)
+{
+	static int tmpfile_supported = -1;	/* -1 = not checked yet */
+	FILE *f;
+	int fd;
+
+	/* Unnamed (O_TMPFILE) files can only be linked (by normal users) via /proc */
+	if (tmpfile_supported < 0)
+		tmpfile_supported = (access("/proc/self/fd", X_OK) == 0 ? 1 : 0);
+	if (!tmpfile_supported)
+		return NULL;
+
+	/* Returns NULL if filesystem does not support unnamed files */
+	fd = open((*tmpdir ? tmpdir : "."), O_TMPFILE | O_WRONLY, S_IWUSR | S_IRUSR);
+	if (fd < 0)
+		return NULL;
+	if (!(f = fdopen(fd, "wb"))) {
+		close(fd);
+		return NULL;
+	}
+
+	return f;
+}
+
+
+char *unnamed_file_path(int fd, char *buf, size_t size)
+{
+	snprintf(buf, size, "/proc/self/fd/%d", fd);
+	return buf;
+}
+
+
+char *unnamed_link_name(int fd, const char *tmpdir, char *buf, size_t size)
+{
+	int len;
+
+	/* Name is unique as long as fd stays open */
+	len = snprintf(buf, size, "%sjpegoptim-%u-%u.%d.tmp",
+		tmpdir, getuid(), getpid(), fd);
+	if (len < 0 || (size_t)len >= size)
+		return NULL;
+	return buf;
+}
+
+
+int link_file(int fd, const char *tmpdir, const char *newname, int replace)
+{
+	char fdpath[64], tmpname[MAXPATHLEN + 1];
+
+	/* Give unnamed file a name directly, if target does not exist... */
+	unnamed_file_path(fd, fdpath, sizeof(fdpath));
+	if (!replace) {
+		if (linkat(AT_FDCWD, fdpath, AT_FDCWD, newname, AT_SYMLINK_FOLLOW) == 0)
+			return 0;
+		if (errno != EEXIST)
+			return -1;
+	}
+
+	/* ...otherwise link it with a temporary name, and rename it over the target */
+	if (!unnamed_link_name(fd, tmpdir, tmpname, sizeof(tmpname)))
+		return -1;
+	if (linkat(AT_FDCWD, fdpath, AT_FDCWD, tmpname, AT_SYMLINK_FOLLOW) != 0) {
+		/* Remove file left behind by a (dead) process with the same pid */
+		if (errno != EEXIST || unlink(tmpname) != 0 ||
+			linkat(AT_FDCWD, fdpath, AT_FDCWD, tmpname, AT_SYMLINK_FOLLOW) != 0)
+			return -1;
+	}
+	if (rename_file(tmpname, newname) != 0) {
+		unlink(tmpname);
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+
 int delete_file(const char *name)
 {
 	int retval;
@@ -127,6 +220,144 @@ long file_size(FILE *fp)
 }
 
 
+void *map_file(FILE *fp, size_t *size)
+{
+#ifdef HAVE_MMAP
+	struct stat buf;
+	void *p;
+
+	/* Map (regular) file to memory, returns NULL if mapping is not possible */
+	if (!fp || fstat(fileno(fp), &buf) != 0)
+		return NULL;
+	if (!S_ISREG(buf.st_mode) || buf.st_size < 1 || (off_t)(size_t)buf.st_size != buf.st_size)
+		return NULL;
+
+	p = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if (p == MAP_FAILED)
+		return NULL;
+#ifdef MADV_SEQUENTIAL
+	madvise(p, buf.st_size, MADV_SEQUENTIAL);
+#endif
+	*size = buf.st_size;
+
+	return p;
+#else
+	return NULL;
+#endif
+}
+
+
+void unmap_file(void *buf, size_t size)
+{
+#ifdef HAVE_MMAP
+	if (buf)
+		munmap(buf, size);
+#endif
+}
+
+
+void *read_file_direct(const char *filename, size_t size, size_t *bufsize, size_t *used)
+{
+#if defined(HAVE_O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)
+	void *buf;
+	size_t got = 0;
+	ssize_t r;
+	int fd;
+
+	/* Read file bypassing page cache, returns NULL if filesystem does not support it */
+	*bufsize = (size + DIRECT_IO_ALIGN - 1) & ~((size_t)DIRECT_IO_ALIGN - 1);
+	if ((fd = open(filename, O_RDONLY | O_DIRECT)) < 0)
+		return NULL;
+	if (posix_memalign(&buf, DIRECT_IO_ALIGN, *bufsize) != 0)
+		fatal("not enough memory");
+
+	while (got < *bufsize) {
+		r = read(fd, (char*)buf + got, *bufsize - got);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		got += r;
+	}
+	close(fd);
+
+	if (got == 0 && size > 0) {
+		free(buf);
+		return NULL;
+	}
+	*used = (got < size ? got : size);
+	return buf;
+#else
+	return NULL;
+#endif
+}
+
+
+void drop_file_cache(int fd, int written)
+{
+#ifdef HAVE_POSIX_FADVISE
+	if (written) {
+		/* Dirty pages cannot be dropped, so wait for them to be written first */
+#ifdef HAVE_SYNC_FILE_RANGE
+		sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+		fdatasync(fd);
+#endif
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+
+int read_stamp(const char *filename, uint64_t options, long long size)
+{
+#if defined(HAVE_SYS_XATTR_H) && defined(HAVE_GETXATTR)
+	char buf[128], version[32];
+	unsigned long long o, s;
+	ssize_t len;
+
+	/* Check if file was stamped using same options, and size has not changed since */
+	if ((len = getxattr(filename, STAMP_XATTR, buf, sizeof(buf) - 1)) <= 0)
+		return 0;
+	buf[len] = 0;
+	if (sscanf(buf, "%31s %llx %llu", version, &o, &s) != 3)
+		return 0;
+
+	return (o == options && (long long)s == size ? 1 : 0);
+#else
+	return 0;
+#endif
+}
+
+
+int write_stamp(const char *filename, const char *version, uint64_t options, long long size)
+{
+#if defined(HAVE_SYS_XATTR_H) && defined(HAVE_SETXATTR)
+	char buf[128];
+	int len;
+
+	/* Stamp contains: program version, hash of the options, and file size */
+	len = snprintf(buf, sizeof(buf), "%s %016llx %lld", version,
+		(unsigned long long)options, size);
+	return setxattr(filename, STAMP_XATTR, buf, len, 0);
+#else
+	return -1;
+#endif
+}
+
+
+int64_t file_mtime(const struct stat *st)
+{
+	/* Modification time in nanoseconds */
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#else
+	return (int64_t)st->st_mtime * 1000000000LL;
+#endif
+}
+
+
 int is_directory(const char *pathname)
 {
 	struct stat buf;
@@ -182,12 +413,42 @@ int rename_file(const char *old_path, const char *new_path)
 
 #define COPY_BUF_SIZE  (256 * 1024)
 
+static off_t copy_file_fast(int in, int out)
+{
+	struct stat st;
+	off_t copied = 0;
+
+	if (fstat(in, &st) != 0 || !S_ISREG(st.st_mode))
+		return 0;
+
+#ifdef HAVE_FICLONE
+	/* Share data blocks with the source file (reflink), if filesystem supports it */
+	if (ioctl(out, FICLONE, in) == 0)
+		return st.st_size;
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	/* Let kernel copy the data (no copying to/from user space)... */
+	while (copied < st.st_size) {
+		ssize_t r = copy_file_range(in, NULL, out, NULL, st.st_size - copied, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		copied += r;
+	}
+#endif
+
+	return copied;
+}
+
+
 int copy_file(const char *srcfile, const char *dstfile)
 {
 	FILE *in,*out;
 	unsigned char *buf;
 	int r,w;
 	int err=0;
+	off_t size;
 
 	if (!srcfile || !dstfile)
 		return -1;
@@ -202,6 +463,15 @@ int copy_file(const char *srcfile, const char *dstfile)
 		return -3;
 	}
 
+	/* Try fast paths first, and copy whatever is left (if any) using a buffer.
+	   File offsets are already past the data copied by copy_file_fast() */
+	size = copy_file_fast(fileno(in), fileno(out));
+	if (size > 0 && size == file_size(in)) {
+		fclose(out);
+		fclose(in);
+		return 0;
+	}
+
 	if (!(buf = calloc(COPY_BUF_SIZE, 1)))
 		fatal("out of memory");
 
@@ -232,6 +502,124 @@ int copy_file(const char *srcfile, const char *dstfile)
 }
 
 
+size_t readn(int fd, void *buf, size_t size)
+{
+	size_t got = 0;
+	ssize_t r;
+
+	/* read() until requested number of bytes is read or EOF/error... */
+	while (got < size) {
+		r = read(fd, (char*)buf + got, size - got);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		got += r;
+	}
+
+	return got;
+}
+
+
+size_t writen(int fd, const void *buf, size_t size)
+{
+	size_t done = 0;
+	ssize_t w;
+
+	while (done < size) {
+		w = write(fd, (const char*)buf + done, size - done);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			break;
+		done += w;
+	}
+
+	return done;
+}
+
+
+#ifdef HAVE_SYS_UIO_H
+size_t writevn(int fd, struct iovec *iov, int iovcnt)
+{
+	size_t done = 0;
+	ssize_t w;
+
+	/* Write all buffers, continuing after partial writes... */
+	while (iovcnt > 0) {
+		if (iov->iov_len == 0) {
+			iov++;
+			iovcnt--;
+			continue;
+		}
+#ifdef HAVE_WRITEV
+		w = writev(fd, iov, iovcnt);
+#else
+		w = write(fd, iov->iov_base, iov->iov_len);
+#endif
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			break;
+		done += w;
+		while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (w > 0) {
+			iov->iov_base = (char*)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+
+	return done;
+}
+#endif
+
+
+double get_time(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#endif
+	return (double)time(NULL);
+}
+
+
+long long parse_size(const char *s)
+{
+	const char *units = "KMGT";
+	const char *p;
+	char *end;
+	double val;
+
+	/* Parse size in bytes with optional K, M, G, or T suffix (powers of 1024) */
+	if (!s)
+		return -1;
+	errno = 0;
+	val = strtod(s, &end);
+	if (errno || end == s || val < 0)
+		return -1;
+
+	if (*end && (p = strchr(units, toupper((unsigned char)*end)))) {
+		for (int i = 0; i <= p - units; i++)
+			val *= 1024;
+		end++;
+		if (*end == 'b' || *end == 'B')
+			end++;
+	}
+
+	if (*end != 0)
+		return -1;
+
+	return (long long)val;
+}
+
+
 char *fgetstr(char *s, size_t size, FILE *stream)
 {
 	char *p;
@@ -0,0 +1,113 @@
+/* prefetch.c
+ *
+ * Copyright (C) 2025 Timo Kokkonen
+ * All Rights Reserved.
+ *
+ * Read ahead upcoming input files (--prefetch), while current files are being processed.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of JPEGoptim.
+ *
+ * JPEGoptim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JPEGoptim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JPEGoptim. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#include "jpegoptim.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+
+static int prefetch_ahead = 0;	/* number of upcoming files already prefetched */
+static int prefetch_uring = 0;
+
+
+
+void prefetch_init(void)
+{
+	prefetch_ahead = 0;
+	prefetch_uring = 0;
+#ifdef HAVE_IO_URING
+	/* Fall back to posix_fadvise() if prefetch ring cannot be set up
+	   (output path still uses io_uring where available) */
+	if (io_uring_mode) {
+		if (uring_prefetch_init() < 0)
+			warn("io_uring not available for reading ahead, using posix_fadvise()");
+		else
+			prefetch_uring = 1;
+	}
+#endif
+}
+
+
+void prefetch_files(int depth)
+{
+	struct file_entry *e;
+	int fd;
+
+	if (depth < 1)
+		return;
+#ifdef HAVE_IO_URING
+	if (prefetch_uring) {
+		uring_prefetch(depth);
+		return;
+	}
+#endif
+	if (depth > LOOKAHEAD_MAX)
+		depth = LOOKAHEAD_MAX;
+
+	/* Called once per file taken from the file list */
+	if (prefetch_ahead > 0)
+		prefetch_ahead--;
+
+	/* Ask kernel to start reading upcoming files (this does not wait for the I/O)... */
+	while (prefetch_ahead < depth && (e = peek_file(prefetch_ahead))) {
+		if (e->regular && e->st.st_size > 0 &&
+			(fd = open(e->name, O_RDONLY | O_CLOEXEC)) >= 0) {
+#ifdef HAVE_POSIX_FADVISE
+			posix_fadvise(fd, 0, e->st.st_size, POSIX_FADV_WILLNEED);
+#endif
+			close(fd);
+		}
+		prefetch_ahead++;
+	}
+}
+
+
+void prefetch_exit(void)
+{
+#ifdef HAVE_IO_URING
+	if (prefetch_uring)
+		uring_prefetch_exit();
+#endif
+	prefetch_uring = 0;
+	prefetch_ahead = 0;
+}
+
+
+/* eof :-) */
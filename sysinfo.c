@@ -0,0 +1,355 @@
+/* sysinfo.c
+ *
+ * Copyright (C) 2025 Timo Kokkonen
+ * All Rights Reserved.
+ *
+ * Functions to query available system resources (CPUs).
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of JPEGoptim.
+ *
+ * JPEGoptim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JPEGoptim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JPEGoptim. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SCHED_GETAFFINITY
+#include <sched.h>
+#endif
+
+#include "jpegoptim.h"
+
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define SYSFS_CPU "/sys/devices/system/cpu"
+
+
+
+static int read_cgroup_path(const char *controller, char *buf, size_t size)
+{
+	char line[MAXPATHLEN + 64];
+	FILE *fp;
+	int found = 0;
+
+	/* Find our cgroup (v2 if controller is NULL) from lines: "id:controllers:path" */
+	if (!(fp = fopen("/proc/self/cgroup", "r")))
+		return 0;
+
+	while (!found && fgetstr(line, sizeof(line), fp)) {
+		char *ctrl, *path;
+
+		if (!(ctrl = strchr(line, ':')) || !(path = strchr(++ctrl, ':')))
+			continue;
+		*path++ = 0;
+		if (controller) {
+			for (char *s = strtok(ctrl, ","); s; s = strtok(NULL, ",")) {
+				if (!strcmp(s, controller))
+					found = 1;
+			}
+		} else {
+			found = (!strncmp(line, "0:", 2) && *ctrl == 0);
+		}
+		if (found)
+			strncopy(buf, path, size);
+	}
+	fclose(fp);
+
+	return found;
+}
+
+
+static double cgroup_cpu_quota(const char *dir, int v2)
+{
+	char fname[MAXPATHLEN + 64];
+	char quota[32];
+	long period = 0;
+	FILE *fp;
+	int res = 0;
+
+	/* cgroup v2: "<quota|max> <period>", v1: cpu.cfs_quota_us + cpu.cfs_period_us */
+	snprintf(fname, sizeof(fname), "%s/%s", dir, (v2 ? "cpu.max" : "cpu.cfs_quota_us"));
+	if ((fp = fopen(fname, "r"))) {
+		res = (v2 ? fscanf(fp, "%31s %ld", quota, &period) == 2 :
+			fscanf(fp, "%31s", quota) == 1);
+		fclose(fp);
+	}
+	if (res && !v2) {
+		snprintf(fname, sizeof(fname), "%s/cpu.cfs_period_us", dir);
+		if ((fp = fopen(fname, "r"))) {
+			res = (fscanf(fp, "%ld", &period) == 1);
+			fclose(fp);
+		}
+	}
+	if (!res || period <= 0 || !strcmp(quota, "max") || atol(quota) <= 0)
+		return 0.0;
+
+	return (double)atol(quota) / period;
+}
+
+
+static double cgroup_cpu_limit(void)
+{
+	char path[MAXPATHLEN + 1];
+	char dir[MAXPATHLEN + 32];
+	double limit = 0.0, quota;
+	int v2 = 1;
+	char *p;
+
+	if (!read_cgroup_path(NULL, path, sizeof(path))) {
+		if (!read_cgroup_path("cpu", path, sizeof(path)))
+			return 0.0;
+		v2 = 0;
+	}
+
+	/* Quota can be set at any level of the hierarchy, use the smallest one */
+	for (;;) {
+		snprintf(dir, sizeof(dir), "%s%s%s", CGROUP_ROOT, (v2 ? "" : "/cpu"), path);
+		quota = cgroup_cpu_quota(dir, v2);
+		if (quota > 0 && (limit <= 0 || quota < limit))
+			limit = quota;
+		if (!(p = strrchr(path, '/')) || p == path) {
+			if (!strcmp(path, "/"))
+				break;
+			strncopy(path, "/", sizeof(path));
+		} else {
+			*p = 0;
+		}
+	}
+
+	return limit;
+}
+
+
+int available_cpus(void)
+{
+	int cpus = 0;
+	double limit;
+
+#ifdef HAVE_SCHED_GETAFFINITY
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		cpus = CPU_COUNT(&set);
+#endif
+#ifdef _SC_NPROCESSORS_ONLN
+	if (cpus < 1)
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (cpus < 1)
+		cpus = 1;
+
+	/* Do not use more CPUs than allowed by (cgroup) CPU quota */
+	if ((limit = cgroup_cpu_limit()) > 0 && limit < cpus) {
+		cpus = (int)limit;
+		if (cpus < limit)
+			cpus++;
+	}
+
+	return cpus;
+}
+
+
+int read_pressure(const char *resource, unsigned long long *total)
+{
+	char fname[64];
+	char line[256];
+	FILE *fp;
+	char *p;
+	int res = -1;
+
+	/* Total stall time (usec) from "some" line of pressure stall information */
+	snprintf(fname, sizeof(fname), "/proc/pressure/%s", resource);
+	if (!(fp = fopen(fname, "r")))
+		return -1;
+	while (fgetstr(line, sizeof(line), fp)) {
+		if (!strncmp(line, "some ", 5) && (p = strstr(line, "total="))) {
+			*total = strtoull(p + 6, NULL, 10);
+			res = 0;
+			break;
+		}
+	}
+	fclose(fp);
+
+	return res;
+}
+
+
+double load_average(void)
+{
+	double load = -1.0;
+
+#ifdef HAVE_GETLOADAVG
+	if (getloadavg(&load, 1) < 1)
+		load = -1.0;
+#endif
+
+	return load;
+}
+
+
+int parse_cpu_list(const char *s, int *cpus, int max)
+{
+	long first, last;
+	char *end;
+	int count = 0;
+
+	/* Parse list of CPUs, for example: "0-3,8,10-11" */
+	while (*s) {
+		first = last = strtol(s, &end, 10);
+		if (end == s || first < 0)
+			return -1;
+		if (*end == '-') {
+			s = end + 1;
+			last = strtol(s, &end, 10);
+			if (end == s || last < first)
+				return -1;
+		}
+		for (long i = first; i <= last && count < max; i++)
+			cpus[count++] = i;
+		if (*end == ',' || *end == '\n')
+			end++;
+		else if (*end != 0)
+			return -1;
+		s = end;
+	}
+
+	return count;
+}
+
+
+static int cpu_core(int cpu)
+{
+	char fname[128];
+	char line[256];
+	int siblings[CPU_LIST_SIZE];
+	FILE *fp;
+	int core = cpu;
+	int count;
+
+	/* Identify core by the lowest numbered (SMT) sibling CPU */
+	snprintf(fname, sizeof(fname), SYSFS_CPU "/cpu%d/topology/thread_siblings_list", cpu);
+	if ((fp = fopen(fname, "r"))) {
+		if (fgetstr(line, sizeof(line), fp) &&
+			(count = parse_cpu_list(line, siblings, CPU_LIST_SIZE)) > 0) {
+			for (int i = 0; i < count; i++) {
+				if (siblings[i] < core)
+					core = siblings[i];
+			}
+		}
+		fclose(fp);
+	}
+
+	return core;
+}
+
+
+int cpu_placement(const char *cpulist, int *cpus, int max)
+{
+	int list[CPU_LIST_SIZE], core[CPU_LIST_SIZE], rank[CPU_LIST_SIZE];
+	int count = 0, n = 0;
+
+	if (max > CPU_LIST_SIZE)
+		max = CPU_LIST_SIZE;
+
+	if (cpulist) {
+		if ((count = parse_cpu_list(cpulist, list, max)) < 1)
+			return -1;
+	} else {
+#ifdef HAVE_SCHED_GETAFFINITY
+		cpu_set_t set;
+
+		if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+			for (int i = 0; i < CPU_SETSIZE && count < max; i++) {
+				if (CPU_ISSET(i, &set))
+					list[count++] = i;
+			}
+		}
+#endif
+		if (count < 1)
+			return 0;
+	}
+
+	/* Use one CPU from each core first, and (SMT) siblings after that */
+	for (int i = 0; i < count; i++) {
+		core[i] = cpu_core(list[i]);
+		rank[i] = 0;
+		for (int j = 0; j < i; j++) {
+			if (core[j] == core[i])
+				rank[i]++;
+		}
+	}
+	for (int r = 0; n < count; r++) {
+		for (int i = 0; i < count; i++) {
+			if (rank[i] == r)
+				cpus[n++] = list[i];
+		}
+	}
+
+	return n;
+}
+
+
+int set_cpu_affinity(int cpu)
+{
+#ifdef HAVE_SCHED_GETAFFINITY
+	cpu_set_t set;
+
+	/* Pin calling process (or thread) to given CPU */
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return -1;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set);
+#else
+	return -1;
+#endif
+}
+
+
+int parse_workers(const char *s)
+{
+	double multiplier;
+	char *end;
+	int workers;
+
+	/* Number of workers: <n>, "auto", or multiplier of available CPUs "<x>x" */
+	if (!strcmp(s, "auto"))
+		return available_cpus();
+
+	multiplier = strtod(s, &end);
+	if (end == s)
+		return -1;
+	if (*end == 'x' && *(end + 1) == 0 && multiplier > 0) {
+		workers = (int)(multiplier * available_cpus() + 0.5);
+		return (workers < 1 ? 1 : workers);
+	}
+	if (*end != 0 || multiplier != (int)multiplier)
+		return -1;
+
+	return (int)multiplier;
+}
+
+
+/* eof :-) */
@@ -21,6 +21,8 @@
 """jpegoptim unit tester"""
 
 import os
+import re
+import shutil
 import subprocess
 import unittest
 
@@ -37,7 +39,7 @@ class JpegoptimTests(unittest.TestCase):
         if "DEBUG" in os.environ:
             self.debug = True
 
-    def run_test(self, args, check=True, directory=None):
+    def run_test(self, args, check=True, directory=None, stdin=None):
         """execute jpegoptim for a test"""
         command = [self.program] + args
         if directory:
@@ -46,7 +48,7 @@ class JpegoptimTests(unittest.TestCase):
             command.extend(['-o', '-d', directory])
         if self.debug:
             print(f'\nRun command: {" ".join(command)}')
-        res = subprocess.run(command, encoding="utf-8", check=check,
+        res = subprocess.run(command, encoding="utf-8", check=check, input=stdin,
                              stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
         output = res.stdout
         if self.debug:
@@ -106,6 +108,375 @@ class JpegoptimTests(unittest.TestCase):
                                     directory='tmp/broken', check=False)
         self.assertRegex(output, r'\s\[WARNING\]\s.*\sskipped\.\s*$')
 
+    def test_workers(self):
+        """test parallel processing"""
+        output, _ = self.run_test(['-w', '2', 'jpegoptim_test1.jpg',
+                                   'jpegoptim_test2.jpg'],
+                                  directory='tmp/workers')
+        self.assertTrue(os.path.exists('tmp/workers/jpegoptim_test1.jpg'))
+        self.assertRegex(output, r'jpegoptim_test1\.jpg\s.*\soptimized\.')
+        self.assertRegex(output, r'jpegoptim_test2\.jpg\s.*\sskipped\.')
+
+    def test_worker_results(self):
+        """test results returned from workers match single process mode"""
+        os.makedirs('tmp/worker_results', exist_ok=True)
+        with open('tmp/worker_results/bad.jpg', 'w', encoding='utf-8') as f:
+            f.write('not a jpeg file')
+        files = ['jpegoptim_test1.jpg', 'tmp/worker_results/bad.jpg',
+                 'jpegoptim_test2.jpg', 'jpegoptim_test2-broken.jpg']
+        expected = self.run_test(['-t', '-n'] + files, check=False)
+        self.assertIn('[ERROR]', expected[0])
+        self.assertEqual(self.run_test(['-t', '-n', '-w', '3', '--ordered'] + files,
+                                       check=False), expected)
+
+    def test_workers_auto(self):
+        """test number of workers relative to available CPUs"""
+        def workers(arg):
+            output, res = self.run_test(['-n', '-v', '-w', arg, 'jpegoptim_test2.jpg'],
+                                        check=False)
+            if res != 0:
+                return None
+            return int(re.search(r'Using maximum of (\d+) parallel', output).group(1))
+        cpus = workers('auto')
+        self.assertGreaterEqual(cpus, 1)
+        self.assertEqual(workers('1x'), cpus)
+        self.assertEqual(workers('0.5x'), max(1, int(cpus * 0.5 + 0.5)))
+        self.assertEqual(workers('2x'), min(256, cpus * 2))
+        self.assertEqual(workers('3'), 3)
+        self.assertIsNone(workers('1.5'))
+        self.assertIsNone(workers('foo'))
+        self.assertIsNone(workers('0x'))
+
+    def test_adaptive(self):
+        """test adjusting number of active workers"""
+        files = ['jpegoptim_test1.jpg', 'jpegoptim_test2.jpg'] * 4
+        output, _ = self.run_test(['-n', '-v', '-v', '-w', '4', '--adaptive'] + files)
+        self.assertEqual(output.count('[OK]'), len(files))
+        # starts with half of the workers, and more only if limit is raised
+        limits = [2] + [int(x) for x in re.findall(r'Active workers: \d+ -> (\d+)', output)]
+        self.assertLessEqual(output.count('started'), max(limits))
+
+    def test_pin(self):
+        """test pinning workers to CPUs"""
+        files = ['jpegoptim_test1.jpg', 'jpegoptim_test2.jpg'] * 2
+        output, _ = self.run_test(['-n', '-v', '-w', '2', '--pin=0'] + files)
+        if 'cannot determine CPUs' in output:
+            self.skipTest('CPU affinity not supported')
+        started = re.findall(r'\] started.*', output)
+        self.assertGreater(len(started), 0)
+        for line in started:
+            self.assertIn('(cpu=0)', line)
+        self.assertEqual(output.count('[OK]'), len(files))
+        _, res = self.run_test(['-n', '-w', '2', '--pin=x', 'jpegoptim_test2.jpg'],
+                               check=False)
+        self.assertNotEqual(res, 0)
+
+    def test_threads(self):
+        """test parallel processing using threads"""
+        output, res = self.run_test(['--threads', '-w', '2', 'jpegoptim_test1.jpg',
+                                     'jpegoptim_test2.jpg'],
+                                    directory='tmp/threads', check=False)
+        if res != 0 and 'unrecognized option' in output:
+            self.skipTest('--threads not supported')
+        self.assertTrue(os.path.exists('tmp/threads/jpegoptim_test1.jpg'))
+        self.assertRegex(output, r'jpegoptim_test1\.jpg\s.*\soptimized\.')
+        self.assertRegex(output, r'jpegoptim_test2\.jpg\s.*\sskipped\.')
+
+    def test_max_memory(self):
+        """test memory limit for parallel workers"""
+        # images larger than the limit must still be processed (one at a time)
+        os.makedirs('tmp/max_memory/in', exist_ok=True)
+        files = []
+        for name in ['a.jpg', 'b.jpg', 'c.jpg']:
+            shutil.copyfile('jpegoptim_test1.jpg', 'tmp/max_memory/in/' + name)
+            files.append('tmp/max_memory/in/' + name)
+        output, _ = self.run_test(['-v', '-v', '-w', '2', '--max-memory=1K'] + files,
+                                  directory='tmp/max_memory')
+        self.assertIn('waiting for memory', output)
+        self.assertEqual(output.count('optimized.'), 3)
+        for name in ['a.jpg', 'b.jpg', 'c.jpg']:
+            self.assertGreater(os.path.getsize('jpegoptim_test1.jpg'),
+                               os.path.getsize('tmp/max_memory/' + name))
+
+    def test_io_uring(self):
+        """test using io_uring for file I/O"""
+        output, res = self.run_test(['--io-uring', 'jpegoptim_test1.jpg',
+                                     'jpegoptim_test2.jpg'],
+                                    directory='tmp/io_uring', check=False)
+        if res != 0 and 'unrecognized option' in output:
+            self.skipTest('--io-uring not supported')
+        self.assertTrue(os.path.exists('tmp/io_uring/jpegoptim_test1.jpg'))
+        self.assertRegex(output, r'jpegoptim_test1\.jpg\s.*\soptimized\.')
+        self.assertRegex(output, r'jpegoptim_test2\.jpg\s.*\sskipped\.')
+        self.assertGreater(os.path.getsize('jpegoptim_test1.jpg'),
+                           os.path.getsize('tmp/io_uring/jpegoptim_test1.jpg'))
+
+    def test_replace_original(self):
+        """test replacing original file (written via unnamed temporary file)"""
+        if os.path.isdir('tmp/replace'):
+            shutil.rmtree('tmp/replace')
+        os.makedirs('tmp/replace')
+        shutil.copyfile('jpegoptim_test1.jpg', 'tmp/replace/test1.jpg')
+        os.chmod('tmp/replace/test1.jpg', 0o640)
+        output, _ = self.run_test(['-v', '-v', 'tmp/replace/test1.jpg'])
+        self.assertRegex(output, r'(linking|renaming): .*test1\.jpg')
+        self.assertEqual(os.stat('tmp/replace/test1.jpg').st_mode & 0o777, 0o640)
+        self.assertGreater(os.path.getsize('jpegoptim_test1.jpg'),
+                           os.path.getsize('tmp/replace/test1.jpg'))
+        # no temporary files left behind
+        self.assertEqual(os.listdir('tmp/replace'), ['test1.jpg'])
+
+    def test_read_mode(self):
+        """test output does not depend on how input files are read"""
+        for mode in ['stream', 'mmap', 'read']:
+            output, _ = self.run_test([f'--read-mode={mode}', '-m80', 'jpegoptim_test1.jpg',
+                                       'jpegoptim_test2.jpg'],
+                                      directory=f'tmp/read_{mode}')
+            self.assertRegex(output, r'jpegoptim_test1\.jpg\s.*\soptimized\.')
+            if mode != 'stream':
+                with open('tmp/read_stream/jpegoptim_test1.jpg', 'rb') as f1, \
+                     open(f'tmp/read_{mode}/jpegoptim_test1.jpg', 'rb') as f2:
+                    self.assertEqual(f1.read(), f2.read())
+        with open('jpegoptim_test1.jpg', 'rb') as f:
+            data = f.read()
+        # standard input is always read as a stream
+        res = subprocess.run([self.program, '--stdin', '--stdout', '-m80'], input=data,
+                             stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, check=True)
+        with open('tmp/read_mmap/jpegoptim_test1.jpg', 'rb') as f:
+            self.assertEqual(res.stdout, f.read())
+
+    def test_save_extra(self):
+        """test preserving extraneous data after end of image"""
+        os.makedirs('tmp/save_extra', exist_ok=True)
+        trailer = bytes(range(256)) * 300
+        with open('jpegoptim_test1.jpg', 'rb') as f:
+            image = f.read()
+        with open('tmp/save_extra/test1.jpg', 'wb') as f:
+            f.write(image + trailer)
+        self.run_test(['tmp/save_extra/test1.jpg'], directory='tmp/save_extra/none')
+        with open('tmp/save_extra/none/test1.jpg', 'rb') as f:
+            plain = f.read()
+        self.assertFalse(plain.endswith(trailer))
+        for mode in ['stream', 'mmap', 'read']:
+            output, _ = self.run_test(['--save-extra', f'--read-mode={mode}',
+                                       'tmp/save_extra/test1.jpg'],
+                                      directory=f'tmp/save_extra/{mode}')
+            self.assertIn('extraneous data found', output)
+            with open(f'tmp/save_extra/{mode}/test1.jpg', 'rb') as f:
+                self.assertEqual(f.read(), plain + trailer)
+
+    def test_multiple_trials(self):
+        """test output written after multiple compression passes"""
+        output, _ = self.run_test(['-v', '--size=150', 'jpegoptim_test1.jpg'],
+                                  directory='tmp/trials')
+        self.assertGreater(output.count('(try '), 1)
+        with open('tmp/trials/jpegoptim_test1.jpg', 'rb') as f:
+            data = f.read()
+        self.assertIn(f'--> {len(data)} bytes', output)
+        self.assertTrue(data.startswith(b'\xff\xd8') and data.endswith(b'\xff\xd9'))
+        for marker in [b'Exif', b'Photoshop 3.0', b'http://ns.adobe.com/xap/1.0/',
+                       b'ICC_PROFILE']:
+            self.assertIn(marker, data)
+        res = subprocess.run([self.program, '--stdout', '--size=150', 'jpegoptim_test1.jpg'],
+                             stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, check=True)
+        self.assertEqual(res.stdout, data)
+
+    def test_copy_skipped(self):
+        """test copying skipped files to destination directory"""
+        output, _ = self.run_test(['--copy-skipped', 'jpegoptim_test1.jpg',
+                                   'jpegoptim_test2.jpg'],
+                                  directory='tmp/copy_skipped')
+        self.assertRegex(output, r'jpegoptim_test2\.jpg\s.*\sskipped\.')
+        with open('jpegoptim_test2.jpg', 'rb') as f1, \
+             open('tmp/copy_skipped/jpegoptim_test2.jpg', 'rb') as f2:
+            self.assertEqual(f1.read(), f2.read())
+
+    def test_fsync(self):
+        """test syncing output files in batch mode"""
+        output, _ = self.run_test(['-t', '-v', '--fsync=batch:1',
+                                   'jpegoptim_test1.jpg', 'jpegoptim_test2.jpg'],
+                                  directory='tmp/fsync')
+        self.assertTrue(os.path.exists('tmp/fsync/jpegoptim_test1.jpg'))
+        self.assertRegex(output, r'write [0-9.]+s, sync [0-9.]+s')
+
+    def test_no_cache(self):
+        """test dropping processed files from page cache"""
+        output, _ = self.run_test(['-v', '--no-cache=1K', 'jpegoptim_test1.jpg'],
+                                  directory='tmp/no_cache')
+        self.assertIn('Dropping processed files from page cache', output)
+        self.assertRegex(output, r'jpegoptim_test1\.jpg\s.*\soptimized\.')
+        self.assertGreater(os.path.getsize('jpegoptim_test1.jpg'),
+                           os.path.getsize('tmp/no_cache/jpegoptim_test1.jpg'))
+
+    def test_cache(self):
+        """test skipping files found in result cache"""
+        cache = 'tmp/cache/results.cache'
+        args = ['--cache=' + cache, 'jpegoptim_test1.jpg', 'jpegoptim_test2.jpg']
+        os.makedirs('tmp/cache', exist_ok=True)
+        if os.path.exists(cache):
+            os.remove(cache)
+        output, _ = self.run_test(args, directory='tmp/cache')
+        self.assertNotIn('[cached]', output)
+        output, _ = self.run_test(args, directory='tmp/cache')
+        self.assertRegex(output, r'jpegoptim_test1\.jpg \[cached\] .*skipped\.')
+        self.assertRegex(output, r'jpegoptim_test2\.jpg \[cached\] .*skipped\.')
+        output, _ = self.run_test(['-m80'] + args, directory='tmp/cache')
+        self.assertNotIn('[cached]', output)
+
+    def test_skip_stamped(self):
+        """test skipping files marked as processed"""
+        os.makedirs('tmp/stamped', exist_ok=True)
+        shutil.copyfile('jpegoptim_test1.jpg', 'tmp/stamped/test1.jpg')
+        output, _ = self.run_test(['--skip-stamped', 'tmp/stamped/test1.jpg'])
+        if 'failed to set extended attribute' in output:
+            self.skipTest('extended attributes not supported')
+        self.assertRegex(output, r'test1\.jpg\s.*\soptimized\.')
+        output, _ = self.run_test(['-t', '--skip-stamped', 'tmp/stamped/test1.jpg'])
+        self.assertRegex(output, r'test1\.jpg \[stamped\] .*skipped\.')
+        self.assertIn('Average compression (0 files): 0.00%', output)
+
+    def test_manifest(self):
+        """test skipping unchanged files listed in manifest"""
+        os.makedirs('tmp/manifest', exist_ok=True)
+        shutil.copyfile('jpegoptim_test1.jpg', 'tmp/manifest/test1.jpg')
+        args = ['--manifest=tmp/manifest/manifest', 'tmp/manifest/test1.jpg']
+        output, _ = self.run_test(args)
+        self.assertRegex(output, r'test1\.jpg\s.*\soptimized\.')
+        output, _ = self.run_test(args)
+        self.assertRegex(output, r'test1\.jpg \[unchanged\] .*skipped\.')
+        shutil.copyfile('jpegoptim_test1.jpg', 'tmp/manifest/test1.jpg')
+        output, _ = self.run_test(args)
+        self.assertRegex(output, r'test1\.jpg\s.*\soptimized\.')
+
+    def test_resume(self):
+        """test resuming interrupted run using journal"""
+        os.makedirs('tmp/resume', exist_ok=True)
+        if os.path.exists('tmp/resume/journal'):
+            os.remove('tmp/resume/journal')
+        shutil.copyfile('jpegoptim_test1.jpg', 'tmp/resume/test1.jpg')
+        shutil.copyfile('jpegoptim_test2.jpg', 'tmp/resume/test2.jpg')
+        with open('tmp/resume/bad.jpg', 'w', encoding='utf-8') as f:
+            f.write('not a jpeg file')
+        journal = ['--journal=tmp/resume/journal']
+        # journal is kept if some files failed
+        output, res = self.run_test(journal + ['tmp/resume/test1.jpg',
+                                               'tmp/resume/bad.jpg'], check=False)
+        self.assertNotEqual(res, 0)
+        self.assertRegex(output, r'test1\.jpg\s.*\soptimized\.')
+        self.assertTrue(os.path.exists('tmp/resume/journal'))
+        # existing journal is not overwritten without --resume
+        output, res = self.run_test(journal + ['tmp/resume/test1.jpg'], check=False)
+        self.assertNotEqual(res, 0)
+        self.assertIn('journal file already exists', output)
+        # ...nor if it was created using different options
+        output, res = self.run_test(journal + ['--resume', '-m80', 'tmp/resume/test1.jpg'],
+                                    check=False)
+        self.assertNotEqual(res, 0)
+        self.assertIn('different options', output)
+        # completed files are skipped, and failed ones retried
+        shutil.copyfile('jpegoptim_test2.jpg', 'tmp/resume/bad.jpg')
+        output, _ = self.run_test(journal + ['--resume', 'tmp/resume/test1.jpg',
+                                             'tmp/resume/test2.jpg', 'tmp/resume/bad.jpg'])
+        self.assertRegex(output, r'test1\.jpg \[resumed\] .*skipped\.')
+        self.assertRegex(output, r'test2\.jpg\s.*\sskipped\.')
+        self.assertNotRegex(output, r'test2\.jpg \[resumed\]')
+        self.assertNotRegex(output, r'bad\.jpg \[resumed\]')
+        # ...and journal is removed after a successful run
+        self.assertFalse(os.path.exists('tmp/resume/journal'))
+        self.run_test(journal + ['tmp/resume/test1.jpg'])
+        self.assertFalse(os.path.exists('tmp/resume/journal'))
+
+    def test_dedup(self):
+        """test reusing results for identical input files"""
+        os.makedirs('tmp/dedup/in', exist_ok=True)
+        for name in ['a.jpg', 'b.jpg', 'c.jpg']:
+            shutil.copyfile('jpegoptim_test1.jpg', 'tmp/dedup/in/' + name)
+        output, res = self.run_test(['-t', '--dedup', 'tmp/dedup/in/a.jpg',
+                                     'tmp/dedup/in/b.jpg', 'tmp/dedup/in/c.jpg'],
+                                    directory='tmp/dedup', check=False)
+        if res != 0 and 'unrecognized option' in output:
+            self.skipTest('--dedup not supported')
+        self.assertIn('Reused results for 2 duplicate files', output)
+        with open('tmp/dedup/a.jpg', 'rb') as f1, \
+             open('tmp/dedup/c.jpg', 'rb') as f2:
+            self.assertEqual(f1.read(), f2.read())
+
+    def test_prefetch(self):
+        """test reading ahead input files"""
+        # more files than LOOKAHEAD_MAX (64), so prefetch window wraps around
+        os.makedirs('tmp/prefetch/in', exist_ok=True)
+        files = []
+        for i in range(70):
+            name = f'tmp/prefetch/in/{i:02d}.jpg'
+            shutil.copyfile(f'jpegoptim_test{i % 2 + 1}.jpg', name)
+            files.append(name)
+        output, _ = self.run_test(['-v', '-f', '--prefetch=64'] + files,
+                                  directory='tmp/prefetch/out')
+        self.assertIn('Reading ahead 64 input files', output)
+        self.run_test(['-f'] + files, directory='tmp/prefetch/ref')
+        for i in range(70):
+            with open(f'tmp/prefetch/out/{i:02d}.jpg', 'rb') as f1, \
+                 open(f'tmp/prefetch/ref/{i:02d}.jpg', 'rb') as f2:
+                self.assertEqual(f1.read(), f2.read())
+
+    def test_prefetch_files_from(self):
+        """test reading ahead files listed in a file (or stdin)"""
+        os.makedirs('tmp/prefetch_list', exist_ok=True)
+        files = []
+        for i in range(10):
+            name = f'tmp/prefetch_list/{i}.jpg'
+            shutil.copyfile('jpegoptim_test2.jpg', name)
+            files.append(name)
+        with open('tmp/prefetch_list/list', 'w', encoding='utf-8') as f:
+            f.write('\n'.join(files) + '\n')
+        for args, stdin in [(['--files-from=tmp/prefetch_list/list'], None),
+                            (['--files-stdin'], '\n'.join(files) + '\n')]:
+            output, _ = self.run_test(['-n', '--prefetch=3'] + args, stdin=stdin)
+            names = [line.split(' ', 1)[0] for line in output.splitlines()]
+            self.assertEqual(names, files)
+
+    def test_order(self):
+        """test processing files in given order"""
+        os.makedirs('tmp/order', exist_ok=True)
+        shutil.copyfile('jpegoptim_test2.jpg', 'tmp/order/small.jpg')
+        shutil.copyfile('jpegoptim_test1.jpg', 'tmp/order/large.jpg')
+        shutil.copyfile('jpegoptim_test2.jpg', 'tmp/order/new.jpg')
+        os.utime('tmp/order/small.jpg', (1000000000, 1000000000))
+        os.utime('tmp/order/large.jpg', (1100000000, 1100000000))
+        os.utime('tmp/order/new.jpg', (1200000000, 1200000000))
+        files = ['tmp/order/small.jpg', 'tmp/order/new.jpg', 'tmp/order/large.jpg']
+        for order, expected in [('input', files),
+                                ('largest', [files[2], files[0], files[1]]),
+                                ('smallest', [files[0], files[1], files[2]]),
+                                ('newest', [files[1], files[2], files[0]])]:
+            output, _ = self.run_test(['-n', '-v', '-v', f'--order={order}'] + files)
+            names = [line.split(': ', 1)[1] for line in output.splitlines()
+                     if line.startswith('processing file: ')]
+            self.assertEqual(names, expected, order)
+
+    def test_ordered(self):
+        """test ordered output from parallel processing"""
+        files = ['jpegoptim_test2.jpg', 'jpegoptim_test1.jpg'] * 3
+        output, _ = self.run_test(['-b', '-n', '-w', '3', '--ordered'] + files)
+        names = [line.split(',')[0] for line in output.splitlines()]
+        self.assertEqual(names, files)
+
+    def test_ordered_skipped(self):
+        """test ordered output with files skipped without processing"""
+        if os.path.isdir('tmp/ordered'):
+            shutil.rmtree('tmp/ordered')
+        os.makedirs('tmp/ordered')
+        shutil.copyfile('jpegoptim_test1.jpg', 'tmp/ordered/big.jpg')
+        for name in ['s1.jpg', 's2.jpg']:
+            shutil.copyfile('jpegoptim_test2.jpg', 'tmp/ordered/' + name)
+        files = ['tmp/ordered/big.jpg', 'tmp/ordered/s1.jpg', 'tmp/ordered/s2.jpg']
+        self.run_test(['--manifest=tmp/ordered/manifest'] + files[1:])
+        output, _ = self.run_test(['-b', '-n', '-w', '2', '--ordered',
+                                   '--manifest=tmp/ordered/manifest'] + files)
+        self.assertIn('skipped', output)
+        names = [line.split(',')[0] for line in output.splitlines()]
+        self.assertEqual(names, files)
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -0,0 +1,528 @@
+/* uring.c
+ *
+ * Copyright (C) 2025 Timo Kokkonen
+ * All Rights Reserved.
+ *
+ * Minimal io_uring interface for batched (asynchronous) file I/O on Linux.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of JPEGoptim.
+ *
+ * JPEGoptim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JPEGoptim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JPEGoptim. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#include "jpegoptim.h"
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 64
+#define URING_MAX_OPS 256	/* max number of opcodes probed */
+
+/* Operations (in low bits of user_data) */
+#define OP_OPEN     1
+#define OP_FADVISE  2
+#define OP_CLOSE    3
+#define OP_MASK     3
+
+
+struct uring {
+	int      fd;
+	unsigned pending;	/* submitted, but not completed operations */
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_local_tail;	/* entries prepared, but not yet submitted */
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void   *sq_ring;
+	size_t sq_ring_size;
+	void   *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	unsigned char supported[URING_MAX_OPS];	/* opcodes supported by the kernel */
+};
+
+/* Input file being read ahead */
+struct prefetch_slot {
+	int    busy;
+	size_t size;
+};
+
+
+static __thread struct uring *thread_ring = NULL;
+static __thread int thread_ring_failed = 0;
+static struct uring *prefetch_ring = NULL;
+static struct prefetch_slot prefetch_slots[LOOKAHEAD_MAX];
+static int prefetch_ahead = 0;	/* number of upcoming files already submitted */
+
+
+
+static void uring_probe(struct uring *r)
+{
+	struct io_uring_probe *probe;
+	size_t size = sizeof(*probe) + URING_MAX_OPS * sizeof(struct io_uring_probe_op);
+
+	/* Find out (once) which operations the kernel supports (probe itself
+	   is not supported by older kernels, in that case nothing is used) */
+	if (!(probe = calloc(1, size)))
+		fatal("not enough memory");
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE,
+			probe, URING_MAX_OPS) == 0) {
+		for (int i = 0; i < probe->ops_len && i < URING_MAX_OPS; i++) {
+			if (probe->ops[i].flags & IO_URING_OP_SUPPORTED)
+				r->supported[probe->ops[i].op] = 1;
+		}
+	}
+	free(probe);
+}
+
+
+static int uring_supports(const struct uring *r, const int *ops)
+{
+	for (; *ops >= 0; ops++) {
+		if (*ops >= URING_MAX_OPS || !r->supported[*ops])
+			return 0;
+	}
+
+	return 1;
+}
+
+
+static struct uring* uring_open(unsigned entries)
+{
+	struct io_uring_params p;
+	struct uring *r;
+	void *ptr;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	if ((fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return NULL;
+
+	if (!(r = calloc(1, sizeof(struct uring))))
+		fatal("not enough memory");
+	r->fd = fd;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+
+	ptr = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	r->sq_ring = ptr;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		ptr = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto fail;
+		r->cq_ring = ptr;
+	}
+	ptr = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto fail;
+	r->sqes = ptr;
+
+	r->sq_head = (unsigned*)((char*)r->sq_ring + p.sq_off.head);
+	r->sq_tail = (unsigned*)((char*)r->sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned*)((char*)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*)((char*)r->sq_ring + p.sq_off.array);
+	r->sq_local_tail = *r->sq_tail;
+	r->cq_head = (unsigned*)((char*)r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned*)((char*)r->cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned*)((char*)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)((char*)r->cq_ring + p.cq_off.cqes);
+	uring_probe(r);
+
+	return r;
+
+ fail:
+	if (r->sq_ring)
+		munmap(r->sq_ring, r->sq_ring_size);
+	if (r->cq_ring && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	close(fd);
+	free(r);
+	return NULL;
+}
+
+
+static void uring_close(struct uring *r)
+{
+	if (!r)
+		return;
+
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	free(r);
+}
+
+
+static struct io_uring_sqe* uring_get_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+	if (r->sq_local_tail - head >= *r->sq_mask + 1)
+		return NULL;
+
+	sqe = &r->sqes[r->sq_local_tail & *r->sq_mask];
+	r->sq_array[r->sq_local_tail & *r->sq_mask] = r->sq_local_tail & *r->sq_mask;
+	r->sq_local_tail++;
+	r->pending++;
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+
+static void uring_discard(struct uring *r, unsigned tail)
+{
+	/* Drop entries prepared (but not yet submitted) after tail */
+	r->pending -= r->sq_local_tail - tail;
+	r->sq_local_tail = tail;
+}
+
+
+static int uring_submit(struct uring *r, unsigned wait_nr)
+{
+	unsigned count = r->sq_local_tail - *r->sq_tail;
+	int res;
+
+	/* Submit prepared entries (and optionally wait for completions) with one system call */
+	__atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+	if (count < 1 && wait_nr < 1)
+		return 0;
+	do {
+		res = syscall(__NR_io_uring_enter, r->fd, count, wait_nr,
+			(wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0), NULL, 0);
+	} while (res < 0 && errno == EINTR);
+
+	return res;
+}
+
+
+static int uring_get_cqe(struct uring *r, int wait, struct io_uring_cqe *cqe)
+{
+	unsigned head;
+
+	for (;;) {
+		head = *r->cq_head;
+		if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			*cqe = r->cqes[head & *r->cq_mask];
+			__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+			r->pending--;
+			return 1;
+		}
+		if (!wait || r->pending < 1)
+			return 0;
+		if (uring_submit(r, 1) < 0)
+			return -1;
+	}
+}
+
+
+
+static struct uring* get_thread_ring(void)
+{
+	/* Each worker (thread or process) uses its own ring */
+	if (!thread_ring && !thread_ring_failed) {
+		if (!(thread_ring = uring_open(URING_ENTRIES)))
+			thread_ring_failed = 1;
+	}
+
+	return thread_ring;
+}
+
+
+void uring_release(void)
+{
+	uring_close(thread_ring);
+	thread_ring = NULL;
+}
+
+
+int uring_write_rename(int fd, struct iovec *iov, int iovcnt, size_t len,
+		const struct timespec *mtime, int do_fsync, const char *linkpath,
+		const char *oldpath, const char *newpath)
+{
+	static const int write_ops[] = { IORING_OP_WRITEV, IORING_OP_FSYNC,
+					 IORING_OP_LINKAT, IORING_OP_RENAMEAT, -1 };
+	struct uring *r;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe cqe;
+	int res[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	unsigned tail;
+	int n = 0;
+
+	/*
+	 * Write output file and move it to the target using a linked chain of
+	 * operations (each step only happens if the previous one succeeded):
+	 * write, fsync (if do_fsync is set), link linkpath as oldpath (or as
+	 * newpath if oldpath is NULL), and rename oldpath over newpath.
+	 * Returns -1 if io_uring is not available (caller should fall back to
+	 * normal I/O), -2 if write failed, -3 if rename failed, and -4 if link
+	 * failed.
+	 *
+	 * Whole chain is submitted with one system call, but the worker still
+	 * waits for it to complete (so this is synchronous for the caller).
+	 */
+	if (!(r = get_thread_ring()) || iovcnt > URING_IOV_MAX)
+		return -1;
+	if (!uring_supports(r, write_ops))
+		return -1;
+
+	tail = r->sq_local_tail;
+	if (!(sqe = uring_get_sqe(r)))
+		return -1;
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)iov;
+	sqe->len = iovcnt;
+	sqe->user_data = 1;
+
+	if (mtime) {
+		/* File modification time can only be set after the write */
+		if (uring_submit(r, 1) < 0)
+			return -2;
+		if (uring_get_cqe(r, 1, &cqe) < 1 || cqe.res != (long)len)
+			return -2;
+		struct timespec ts[2];
+		ts[0].tv_sec = 0;
+		ts[0].tv_nsec = UTIME_OMIT;
+		ts[1] = *mtime;
+		if (futimens(fd, ts) != 0)
+			warn("failed to reset output file time/date");
+		res[1] = len;
+		tail = r->sq_local_tail;
+	} else {
+		sqe->flags |= IOSQE_IO_LINK;
+		n++;
+	}
+
+	if (do_fsync) {
+		if (!(sqe = uring_get_sqe(r)))
+			goto no_space;
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = fd;
+		sqe->user_data = 4;
+		sqe->flags |= IOSQE_IO_LINK;
+		n++;
+	}
+
+	if (linkpath) {
+		if (!(sqe = uring_get_sqe(r)))
+			goto no_space;
+		sqe->opcode = IORING_OP_LINKAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (unsigned long)linkpath;
+		sqe->len = AT_FDCWD;
+		sqe->addr2 = (unsigned long)(oldpath ? oldpath : newpath);
+		sqe->hardlink_flags = AT_SYMLINK_FOLLOW;
+		sqe->user_data = 2;
+		n++;
+		if (oldpath)
+			sqe->flags |= IOSQE_IO_LINK;
+	}
+
+	if (oldpath) {
+		if (!(sqe = uring_get_sqe(r)))
+			goto no_space;
+		sqe->opcode = IORING_OP_RENAMEAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (unsigned long)oldpath;
+		sqe->len = AT_FDCWD;
+		sqe->off = (unsigned long)newpath;
+		sqe->user_data = 3;
+		n++;
+	}
+
+	if (uring_submit(r, n) < 0)
+		return -2;
+	while (n-- > 0) {
+		if (uring_get_cqe(r, 1, &cqe) < 1)
+			return -2;
+		res[cqe.user_data & 7] = cqe.res;
+	}
+
+	if (res[1] != (long)len)
+		return -2;
+	if (do_fsync && res[4] != 0)
+		return -2;
+	if (linkpath && res[2] != 0)
+		return -4;
+	if (oldpath && res[3] != 0) {
+		if (linkpath)
+			unlink(oldpath);
+		return -3;
+	}
+
+	return 0;
+
+ no_space:
+	/* Do not leave partial chain (pointing to caller's iovecs) in the queue */
+	uring_discard(r, tail);
+	return -1;
+}
+
+
+
+int uring_prefetch_init(void)
+{
+	static const int prefetch_ops[] = { IORING_OP_OPENAT, IORING_OP_FADVISE,
+					    IORING_OP_CLOSE, -1 };
+
+	if (!(prefetch_ring = uring_open(URING_ENTRIES)))
+		return -1;
+	if (!uring_supports(prefetch_ring, prefetch_ops)) {
+		uring_prefetch_exit();
+		return -1;
+	}
+	return 0;
+}
+
+
+static void prefetch_complete(void)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe cqe;
+	struct prefetch_slot *s;
+
+	/* Handle completed operations, and queue next step for opened files... */
+	while (uring_get_cqe(prefetch_ring, 0, &cqe) > 0) {
+		s = &prefetch_slots[cqe.user_data >> 2];
+		if ((cqe.user_data & OP_MASK) != OP_OPEN) {
+			if ((cqe.user_data & OP_MASK) == OP_CLOSE)
+				s->busy = 0;
+			continue;
+		}
+		if (cqe.res < 0) {
+			s->busy = 0;
+			continue;
+		}
+		/* Start read ahead of the whole file, then close it */
+		if (!(sqe = uring_get_sqe(prefetch_ring))) {
+			close(cqe.res);
+			s->busy = 0;
+			continue;
+		}
+		sqe->opcode = IORING_OP_FADVISE;
+		sqe->fd = cqe.res;
+		sqe->off = 0;
+		sqe->len = s->size;
+		sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+		sqe->flags |= IOSQE_IO_HARDLINK;
+		sqe->user_data = (cqe.user_data & ~OP_MASK) | OP_FADVISE;
+		if (!(sqe = uring_get_sqe(prefetch_ring)))
+			fatal("io_uring submission queue full");
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = cqe.res;
+		sqe->user_data = (cqe.user_data & ~OP_MASK) | OP_CLOSE;
+	}
+}
+
+
+void uring_prefetch(int depth)
+{
+	struct io_uring_sqe *sqe;
+	struct file_entry *e;
+	int slot;
+
+	if (!prefetch_ring)
+		return;
+	if (depth > LOOKAHEAD_MAX)
+		depth = LOOKAHEAD_MAX;
+
+	/* Called once per file taken from the file list */
+	if (prefetch_ahead > 0)
+		prefetch_ahead--;
+
+	prefetch_complete();
+
+	/* Open (asynchronously) upcoming files not yet submitted... */
+	while (prefetch_ahead < depth && (e = peek_file(prefetch_ahead))) {
+		if (e->regular && e->st.st_size > 0) {
+			for (slot = 0; slot < LOOKAHEAD_MAX && prefetch_slots[slot].busy; slot++)
+				;
+			if (slot >= LOOKAHEAD_MAX || !(sqe = uring_get_sqe(prefetch_ring)))
+				break;
+			prefetch_slots[slot].busy = 1;
+			prefetch_slots[slot].size = e->st.st_size;
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (unsigned long)e->name;
+			sqe->open_flags = O_RDONLY | O_CLOEXEC;
+			sqe->user_data = ((unsigned long long)slot << 2) | OP_OPEN;
+		}
+		prefetch_ahead++;
+	}
+
+	/* ...all in one system call */
+	if (uring_submit(prefetch_ring, 0) < 0) {
+		warn("io_uring_enter() failed, disabling prefetch");
+		uring_prefetch_exit();
+	}
+}
+
+
+void uring_prefetch_exit(void)
+{
+	uring_close(prefetch_ring);
+	prefetch_ring = NULL;
+	memset(prefetch_slots, 0, sizeof(prefetch_slots));
+	prefetch_ahead = 0;
+}
+
+
+#endif /* HAVE_IO_URING */
+
+/* eof :-) */
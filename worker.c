@@ -0,0 +1,817 @@
+/* worker.c
+ *
+ * Copyright (C) 2025 Timo Kokkonen
+ * All Rights Reserved.
+ *
+ * Worker pool (processes or threads) for parallel processing of files.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ *
+ * This file is part of JPEGoptim.
+ *
+ * JPEGoptim is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * JPEGoptim is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with JPEGoptim. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#if HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+#include "jpegoptim.h"
+
+#ifdef PARALLEL_PROCESSING
+#include <poll.h>
+#ifdef WORKER_THREADS
+#include <pthread.h>
+#endif
+
+#define WORKER_READ_SIZE (64 * 1024)
+#define REORDER_WINDOW_FACTOR 8
+
+/* Adaptive concurrency (--adaptive) */
+#define ADAPTIVE_INTERVAL 1.0	/* minimum seconds between adjustments */
+#define ADAPTIVE_POLL_TIMEOUT 250
+#define ADAPTIVE_HOLD 10	/* intervals to wait before increasing again after backing off */
+#define PRESSURE_HIGH 20.0	/* % of time stalled (cpu, io, or memory) */
+#define PRESSURE_LOW 5.0
+#define LOAD_HIGH 1.5		/* load average per CPU */
+#define LOAD_LOW 1.0
+
+
+struct worker {
+	pid_t pid;		/* process id (or thread number) of the worker */
+	int   cpu;		/* CPU worker is pinned to (--pin), or -1 */
+	int   read_pipe;	/* log output and results from worker */
+	int   write_pipe;	/* jobs to worker */
+	int   busy;
+	int   idle;		/* worker is in the idle_workers stack */
+	long long mem;		/* estimated memory use of current job */
+	long  seq;		/* sequence number of current job */
+	char  filename[MAXPATHLEN + 1];	/* file being processed */
+	char  newname[MAXPATHLEN + 1];	/* output file */
+
+	/* Partial line of log output received from the worker */
+	char  *line;
+	size_t line_len;
+	size_t line_size;
+
+	/* Result record (being) received from the worker */
+	struct job_result result;
+	int   result_len;	/* -1 = receiving log output */
+#ifdef WORKER_THREADS
+	pthread_t thread;
+	int   job_fd;		/* worker thread's end of the job pipe */
+	int   out_fd;		/* worker thread's end of the output pipe */
+#endif
+};
+
+/* Job message sent to a worker */
+struct worker_job {
+	struct stat file_stat;
+	char filename[MAXPATHLEN + 1];
+	char newname[MAXPATHLEN + 1];
+	char tmpdir[MAXPATHLEN + 1];
+};
+
+/* Job waiting for memory to become available (--max-memory) */
+struct deferred_job {
+	struct worker_job job;
+	long long mem;
+	int skipped;		/* number of jobs started ahead of this one */
+	long seq;
+};
+
+/* Buffered output of a job that finished (or is running) ahead of its turn (--ordered) */
+struct reorder_slot {
+	char  *buf;
+	size_t len;
+	size_t size;
+	int    done;
+};
+
+
+static struct worker *workers = NULL;
+static struct pollfd *worker_fds = NULL;	/* indexed same as workers */
+static int *idle_workers = NULL;
+static int idle_count = 0;
+static int *free_slots = NULL;
+static int free_count = 0;
+static int worker_count = 0;
+static int busy_count = 0;
+static long long mem_in_use = 0;
+static struct deferred_job *deferred = NULL;
+static int deferred_count = 0;
+static int max_deferred = 0;
+static struct reorder_slot *reorder = NULL;
+static int reorder_window = 0;
+static long next_seq = 0;	/* sequence number for next job */
+static long emit_seq = 0;	/* sequence number of next job to output */
+
+static int *worker_cpus = NULL;	/* CPUs for worker slots (--pin) */
+static int worker_cpu_count = 0;
+
+static const char *pressure_resources[] = { "cpu", "io", "memory" };
+
+static struct adaptive_state {
+	int    limit;		/* number of workers allowed to be busy */
+	int    cpus;
+	int    increased;	/* last adjustment was an increase */
+	int    hold;
+	long   completed;	/* jobs completed during current interval */
+	double rate;		/* jobs/sec during previous interval */
+	double last_time;
+	unsigned long long stall[3];
+} adaptive;
+
+
+
+static void worker_process(int job_fd, int out_fd)
+{
+	struct worker_job job;
+	struct job_result result;
+	FILE *p;
+
+	if (!(p = fdopen(out_fd, "w")))
+		fatal("worker: fdopen failed");
+
+	/* Process jobs until parent closes the job pipe... */
+	while (readn(job_fd, &job, sizeof(job)) == sizeof(job)) {
+		optimize(p, job.filename, job.newname, job.tmpdir,
+			&job.file_stat, &result);
+		/* End of log output is marked with NUL, followed by the result record */
+		putc(0, p);
+		fwrite(&result, sizeof(result), 1, p);
+		fflush(p);
+	}
+
+#ifdef HAVE_IO_URING
+	uring_release();
+#endif
+	sync_flush();
+	fclose(p);
+	close(job_fd);
+}
+
+
+#ifdef WORKER_THREADS
+static void *worker_thread(void *arg)
+{
+	struct worker *w = (struct worker*)arg;
+
+	if (w->cpu >= 0 && set_cpu_affinity(w->cpu) < 0)
+		warn("worker[%d]: failed to set CPU affinity", w->pid);
+	worker_process(w->job_fd, w->out_fd);
+
+	return NULL;
+}
+#endif
+
+
+void init_workers(void)
+{
+	if (!(workers = calloc(max_workers, sizeof(struct worker))))
+		fatal("not enough memory");
+	if (!(worker_fds = calloc(max_workers, sizeof(struct pollfd))))
+		fatal("not enough memory");
+	if (!(idle_workers = calloc(max_workers, sizeof(int))))
+		fatal("not enough memory");
+	if (!(free_slots = calloc(max_workers, sizeof(int))))
+		fatal("not enough memory");
+
+	for (int i = 0; i < max_workers; i++) {
+		workers[i].pid = -1;
+		workers[i].read_pipe = -1;
+		workers[i].write_pipe = -1;
+		workers[i].result_len = -1;
+		worker_fds[i].fd = -1;
+		worker_fds[i].events = POLLIN;
+		free_slots[max_workers - 1 - i] = i;
+	}
+	free_count = max_workers;
+
+	if (pin_mode) {
+		if (!(worker_cpus = calloc(CPU_LIST_SIZE, sizeof(int))))
+			fatal("not enough memory");
+		if ((worker_cpu_count = cpu_placement(pin_cpus, worker_cpus, CPU_LIST_SIZE)) < 1)
+			warn("cannot determine CPUs to pin workers to");
+	}
+
+	if (adaptive_mode) {
+		adaptive.limit = (max_workers + 1) / 2;
+		adaptive.cpus = available_cpus();
+		adaptive.last_time = get_time();
+		for (int i = 0; i < 3; i++) {
+			if (read_pressure(pressure_resources[i], &adaptive.stall[i]) < 0)
+				adaptive.stall[i] = 0;
+		}
+	}
+
+	if (ordered_output) {
+		reorder_window = max_workers * REORDER_WINDOW_FACTOR;
+		if (!(reorder = calloc(reorder_window, sizeof(struct reorder_slot))))
+			fatal("not enough memory");
+	}
+
+	if (max_memory > 0) {
+		max_deferred = max_workers * 4;
+		if (!(deferred = calloc(max_deferred, sizeof(struct deferred_job))))
+			fatal("not enough memory");
+	}
+
+	/* Detect dead workers from write() errors instead of getting killed... */
+#ifdef SIGPIPE
+	signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+
+static void start_worker(FILE *log_fh)
+{
+	struct worker *w;
+	int job_pipe[2], out_pipe[2];
+	int slot;
+
+	if (free_count < 1)
+		fatal("no space to start a new worker (%d)", worker_count);
+	slot = free_slots[--free_count];
+	w = &workers[slot];
+
+	if (pipe(job_pipe) < 0 || pipe(out_pipe) < 0)
+		fatal("failed to open pipe");
+	w->read_pipe = out_pipe[0];
+	w->write_pipe = job_pipe[1];
+	w->busy = 0;
+	w->line_len = 0;
+	w->result_len = -1;
+	w->cpu = (worker_cpu_count > 0 ? worker_cpus[slot % worker_cpu_count] : -1);
+	if (fcntl(w->read_pipe, F_SETFL, O_NONBLOCK) < 0)
+		fatal("fcntl() failed");
+
+#ifdef WORKER_THREADS
+	if (thread_mode) {
+		/* Worker threads share everything (except the pipes) with main thread */
+		w->pid = slot + 1;
+		w->job_fd = job_pipe[0];
+		w->out_fd = out_pipe[1];
+		if (pthread_create(&w->thread, NULL, worker_thread, w) != 0)
+			fatal("pthread_create() failed");
+	}
+#endif
+#ifdef WORKER_PROCESSES
+	if (!thread_mode) {
+		pid_t pid;
+
+		fflush(log_fh);
+		pid = fork();
+		if (pid < 0)
+			fatal("fork() failed");
+		if (pid == 0) {
+			/* Child process starts here... */
+			if (files_from)
+				fclose(files_from);
+			/* prefetching is done by the parent */
+			prefetch_exit();
+			/* close pipes of the other workers, so they get EOF when parent exits */
+			for (int i = 0; i < max_workers; i++) {
+				if (workers[i].pid < 0)
+					continue;
+				close(workers[i].read_pipe);
+				close(workers[i].write_pipe);
+			}
+			close(out_pipe[0]);
+			close(job_pipe[1]);
+			if (w->cpu >= 0 && set_cpu_affinity(w->cpu) < 0)
+				warn("worker[%d]: failed to set CPU affinity", (int)getpid());
+			worker_process(job_pipe[0], out_pipe[1]);
+			exit(0);
+		}
+
+		/* Parent continues here... */
+		close(job_pipe[0]);
+		close(out_pipe[1]);
+		w->pid = pid;
+	}
+#endif
+
+	worker_fds[slot].fd = w->read_pipe;
+	worker_fds[slot].revents = 0;
+	idle_workers[idle_count++] = slot;
+	w->idle = 1;
+	worker_count++;
+	if (verbose_mode > 0) {
+		if (w->cpu >= 0)
+			fprintf(log_fh, "worker[%d] [slot=%d] started (cpu=%d)\n", w->pid, slot, w->cpu);
+		else
+			fprintf(log_fh, "worker[%d] [slot=%d] started\n", w->pid, slot);
+	}
+}
+
+
+static void reorder_append(struct reorder_slot *r, const char *data, size_t len)
+{
+	if (r->len + len > r->size) {
+		size_t newsize = r->len + len + 4096;
+		char *newbuf = realloc(r->buf, newsize);
+
+		if (!newbuf)
+			fatal("not enough memory");
+		r->buf = newbuf;
+		r->size = newsize;
+	}
+	memcpy(r->buf + r->len, data, len);
+	r->len += len;
+}
+
+
+static void worker_output(FILE *log_fh, struct worker *w, const char *data, size_t len,
+			int end_of_job)
+{
+	size_t n = len;
+
+	if (ordered_output) {
+		struct reorder_slot *r = &reorder[w->seq % reorder_window];
+
+		if (w->seq != emit_seq) {
+			/* Not this job's turn yet, save output for later... */
+			reorder_append(r, data, len);
+			return;
+		}
+		if (r->len > 0) {
+			fwrite(r->buf, 1, r->len, log_fh);
+			r->len = 0;
+		}
+	}
+
+	/* Pass through only complete lines, so output from workers does not get mixed up */
+	if (!end_of_job) {
+		while (n > 0 && data[n - 1] != '\n')
+			n--;
+	}
+
+	if (n > 0) {
+		if (w->line_len > 0) {
+			fwrite(w->line, 1, w->line_len, log_fh);
+			w->line_len = 0;
+		}
+		fwrite(data, 1, n, log_fh);
+		fflush(log_fh);
+	}
+
+	if (n < len) {
+		/* Save partial line for later... */
+		if (w->line_len + (len - n) > w->line_size) {
+			size_t newsize = w->line_len + (len - n) + 1024;
+			char *newline = realloc(w->line, newsize);
+
+			if (!newline)
+				fatal("not enough memory");
+			w->line = newline;
+			w->line_size = newsize;
+		}
+		memcpy(w->line + w->line_len, data + n, len - n);
+		w->line_len += len - n;
+	}
+}
+
+
+static void output_done(FILE *log_fh, long seq)
+{
+	struct reorder_slot *r;
+
+	/* Output results of all finished jobs that are next in turn... */
+	reorder[seq % reorder_window].done = 1;
+	while (emit_seq < next_seq && (r = &reorder[emit_seq % reorder_window])->done) {
+		if (r->len > 0) {
+			fwrite(r->buf, 1, r->len, log_fh);
+			r->len = 0;
+		}
+		r->done = 0;
+		emit_seq++;
+	}
+	fflush(log_fh);
+}
+
+
+static void job_done(FILE *log_fh, struct worker *w)
+{
+	if (ordered_output)
+		output_done(log_fh, w->seq);
+}
+
+
+static void worker_input(FILE *log_fh, struct worker *w, const char *data, size_t len)
+{
+	const char *end;
+	size_t n;
+
+	while (len > 0) {
+		if (w->result_len < 0) {
+			/* Log output, until end of job marker (NUL) */
+			end = memchr(data, 0, len);
+			n = (end ? (size_t)(end - data) : len);
+			worker_output(log_fh, w, data, n, (end != NULL));
+			if (!end)
+				break;
+			data += n + 1;
+			len -= n + 1;
+			w->result_len = 0;
+		} else {
+			/* Result record */
+			n = sizeof(w->result) - w->result_len;
+			if (n > len)
+				n = len;
+			memcpy((char*)&w->result + w->result_len, data, n);
+			w->result_len += n;
+			data += n;
+			len -= n;
+			if (w->result_len == sizeof(w->result)) {
+				w->result_len = -1;
+				w->busy = 0;
+				busy_count--;
+				mem_in_use -= w->mem;
+				w->mem = 0;
+				idle_workers[idle_count++] = (w - workers);
+				w->idle = 1;
+				update_totals(w->filename, w->newname, &w->result);
+				job_done(log_fh, w);
+				adaptive.completed++;
+			}
+		}
+	}
+}
+
+
+static void reap_worker(FILE *log_fh, struct worker *w)
+{
+	int slot = (w - workers);
+	const struct reorder_slot *r = (ordered_output ? &reorder[w->seq % reorder_window] : NULL);
+
+	if (w->busy && (w->line_len > 0 || (r && r->len > 0 && r->buf[r->len - 1] != '\n'))) {
+		/* Terminate partial line of output from a job that did not finish */
+		worker_output(log_fh, w, "\n", 1, 1);
+	} else if (w->line_len > 0) {
+		worker_output(log_fh, w, "", 0, 1);
+	}
+	close(w->read_pipe);
+	if (w->write_pipe >= 0)
+		close(w->write_pipe);
+
+#ifdef WORKER_THREADS
+	if (thread_mode) {
+		if (pthread_join(w->thread, NULL) != 0)
+			fatal("pthread_join() failed");
+		if (verbose_mode)
+			fprintf(log_fh, "worker[%d] [slot=%d] exited\n", w->pid, slot);
+	}
+#endif
+#ifdef WORKER_PROCESSES
+	if (!thread_mode) {
+		int wstatus;
+
+		while (waitpid(w->pid, &wstatus, 0) < 0) {
+			if (errno != EINTR)
+				fatal("waitpid() failed");
+		}
+		if (WIFEXITED(wstatus)) {
+			if (verbose_mode)
+				fprintf(log_fh, "worker[%d] [slot=%d] exited: %d\n",
+					w->pid, slot, WEXITSTATUS(wstatus));
+		} else if (WIFSIGNALED(wstatus)) {
+			warn("worker[%d] killed by signal %d", w->pid, WTERMSIG(wstatus));
+		}
+	}
+#endif
+
+	if (w->busy) {
+		/* Worker died while processing a file, record the file as failed */
+		struct job_result result;
+
+		warn("worker[%d] terminated unexpectedly while processing: %s",
+			w->pid, w->filename);
+		busy_count--;
+		mem_in_use -= w->mem;
+		memset(&result, 0, sizeof(result));
+		result.status = 3;
+		update_totals(w->filename, w->newname, &result);
+		job_done(log_fh, w);
+	}
+	if (w->idle) {
+		for (int i = 0; i < idle_count; i++) {
+			if (idle_workers[i] == slot) {
+				idle_workers[i] = idle_workers[--idle_count];
+				break;
+			}
+		}
+	}
+
+	free(w->line);
+	w->line = NULL;
+	w->line_len = w->line_size = 0;
+	w->pid = -1;
+	w->read_pipe = -1;
+	w->write_pipe = -1;
+	w->busy = 0;
+	w->idle = 0;
+	w->mem = 0;
+	worker_fds[slot].fd = -1;
+	free_slots[free_count++] = slot;
+	worker_count--;
+}
+
+
+static int poll_workers(FILE *log_fh, int timeout)
+{
+	char buf[WORKER_READ_SIZE];
+	struct worker *w;
+	ssize_t len;
+	int ready;
+
+	if ((ready = poll(worker_fds, max_workers, timeout)) < 0) {
+		if (errno == EINTR)
+			return 0;
+		fatal("poll() failed");
+	}
+
+	for (int i = 0; i < max_workers && ready > 0; i++) {
+		if (!worker_fds[i].revents)
+			continue;
+		ready--;
+		w = &workers[i];
+
+		len = read(w->read_pipe, buf, sizeof(buf));
+		if (len > 0) {
+			worker_input(log_fh, w, buf, len);
+		} else if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+			/* Worker has exited (or closed its output pipe) */
+			reap_worker(log_fh, w);
+		}
+	}
+
+	return ready;
+}
+
+
+static void adjust_concurrency(FILE *log_fh)
+{
+	unsigned long long stall[3];
+	double now = get_time();
+	double elapsed = now - adaptive.last_time;
+	double pressure = 0.0, load, rate;
+	int limit = adaptive.limit;
+	int high;
+
+	if (elapsed < ADAPTIVE_INTERVAL)
+		return;
+
+	/* Percentage of time some tasks were stalled (cpu, io, or memory) during the interval */
+	for (int i = 0; i < 3; i++) {
+		double p;
+
+		if (read_pressure(pressure_resources[i], &stall[i]) < 0) {
+			stall[i] = 0;
+			continue;
+		}
+		p = (stall[i] - adaptive.stall[i]) / (elapsed * 10000.0);
+		if (p > pressure)
+			pressure = p;
+	}
+	load = load_average() / adaptive.cpus;
+	high = (pressure > PRESSURE_HIGH || load > LOAD_HIGH);
+
+	/* Wait until there is enough completed jobs to measure throughput */
+	if (!high && adaptive.completed < adaptive.limit && elapsed < ADAPTIVE_INTERVAL * 10)
+		return;
+	rate = adaptive.completed / elapsed;
+
+	if (high) {
+		/* Back off when system is under pressure... */
+		limit -= (limit / 4 > 1 ? limit / 4 : 1);
+		adaptive.hold = ADAPTIVE_HOLD;
+	} else if (adaptive.increased && rate < adaptive.rate * 1.05) {
+		/* More workers did not increase throughput */
+		limit--;
+		adaptive.hold = ADAPTIVE_HOLD;
+	} else if (adaptive.hold > 0) {
+		adaptive.hold--;
+	} else if (pressure < PRESSURE_LOW && load < LOAD_LOW) {
+		/* ...and ramp up when system is idle */
+		limit++;
+	}
+	if (limit > max_workers)
+		limit = max_workers;
+	if (limit < 1)
+		limit = 1;
+
+	if (verbose_mode > 1 || (verbose_mode && limit != adaptive.limit))
+		fprintf(log_fh, "Active workers: %d -> %d (pressure %0.1f%%, load %0.2f, %0.2f files/s)\n",
+			adaptive.limit, limit, pressure, load * adaptive.cpus, rate);
+	adaptive.increased = (limit > adaptive.limit);
+	adaptive.limit = limit;
+	adaptive.rate = rate;
+	adaptive.completed = 0;
+	adaptive.last_time = now;
+	memcpy(adaptive.stall, stall, sizeof(stall));
+}
+
+
+static void send_job(FILE *log_fh, const struct worker_job *job, long long mem, long seq)
+{
+	struct worker *w;
+
+	if (adaptive_mode)
+		adjust_concurrency(log_fh);
+
+	/* Wait for an idle worker, or start a new one if there is room for more... */
+	while (idle_count < 1 || (adaptive_mode && busy_count >= adaptive.limit)) {
+		if (idle_count < 1 && worker_count < max_workers &&
+			!(adaptive_mode && busy_count >= adaptive.limit)) {
+			start_worker(log_fh);
+		} else {
+			poll_workers(log_fh, (adaptive_mode ? ADAPTIVE_POLL_TIMEOUT : -1));
+			if (adaptive_mode)
+				adjust_concurrency(log_fh);
+		}
+	}
+	w = &workers[idle_workers[--idle_count]];
+	w->idle = 0;
+
+	if (writen(w->write_pipe, job, sizeof(*job)) != sizeof(*job))
+		fatal("failed to send job to worker[%d]", w->pid);
+	w->busy = 1;
+	w->mem = mem;
+	w->seq = seq;
+	strncopy(w->filename, job->filename, sizeof(w->filename));
+	strncopy(w->newname, job->newname, sizeof(w->newname));
+	busy_count++;
+	mem_in_use += mem;
+	if (verbose_mode > 2)
+		fprintf(log_fh, "worker[%d] [slot=%ld] processing: %s (%lldK)\n",
+			w->pid, (long)(w - workers), job->filename, mem / 1024);
+}
+
+
+static int job_fits(long long mem)
+{
+	/* Always allow one job at a time, even if it exceeds the limit */
+	return (busy_count < 1 || mem_in_use + mem <= max_memory);
+}
+
+
+static void start_deferred_jobs(FILE *log_fh)
+{
+	int i = 0;
+
+	/* Start (oldest first) deferred jobs that fit within the memory limit */
+	while (i < deferred_count) {
+		/* ...but don't let the oldest job wait forever */
+		if (i > 0 && deferred[0].skipped >= max_workers)
+			break;
+		if (!job_fits(deferred[i].mem)) {
+			i++;
+			continue;
+		}
+		send_job(log_fh, &deferred[i].job, deferred[i].mem, deferred[i].seq);
+		for (int j = 0; j < i; j++)
+			deferred[j].skipped++;
+		deferred_count--;
+		memmove(&deferred[i], &deferred[i + 1],
+			(deferred_count - i) * sizeof(struct deferred_job));
+		/* send_job() may have polled workers and freed memory... */
+		i = 0;
+	}
+}
+
+
+static long next_job_seq(FILE *log_fh)
+{
+	/* Limit how far ahead of the oldest unfinished job we can get (--ordered) */
+	while (ordered_output && next_seq - emit_seq >= reorder_window) {
+		start_deferred_jobs(log_fh);
+		if (next_seq - emit_seq >= reorder_window)
+			poll_workers(log_fh, -1);
+	}
+	return next_seq++;
+}
+
+
+void dispatch_output(FILE *log_fh, const char *text)
+{
+	long seq;
+
+	/* Output for a file handled without a worker (skipped), in turn with job results */
+	if (!ordered_output) {
+		fputs(text, log_fh);
+		fflush(log_fh);
+		return;
+	}
+	seq = next_job_seq(log_fh);
+	reorder_append(&reorder[seq % reorder_window], text, strlen(text));
+	output_done(log_fh, seq);
+}
+
+
+void dispatch_job(FILE *log_fh, const char *filename, const char *newname,
+		const char *tmpdir, struct stat *file_stat)
+{
+	struct worker_job job;
+	long long mem = 0;
+	long seq;
+
+	seq = next_job_seq(log_fh);
+
+	memset(&job, 0, sizeof(job));
+	job.file_stat = *file_stat;
+	strncopy(job.filename, filename, sizeof(job.filename));
+	strncopy(job.newname, newname, sizeof(job.newname));
+	strncopy(job.tmpdir, tmpdir, sizeof(job.tmpdir));
+
+	if (max_memory < 1) {
+		send_job(log_fh, &job, 0, seq);
+		return;
+	}
+
+	/*
+	 * Admit job only if its estimated memory use fits within the limit,
+	 * otherwise defer it and let smaller jobs go ahead (for a while).
+	 */
+	mem = estimate_memory(filename, file_stat);
+	for (;;) {
+		start_deferred_jobs(log_fh);
+		if (deferred_count < 1 || deferred[0].skipped < max_workers) {
+			if (job_fits(mem)) {
+				if (deferred_count > 0)
+					deferred[0].skipped++;
+				send_job(log_fh, &job, mem, seq);
+				return;
+			}
+			if (deferred_count < max_deferred) {
+				if (verbose_mode > 1)
+					fprintf(log_fh, "waiting for memory (%lldK in use, %lldK needed): %s\n",
+						mem_in_use / 1024, mem / 1024, filename);
+				deferred[deferred_count].job = job;
+				deferred[deferred_count].mem = mem;
+				deferred[deferred_count].skipped = 0;
+				deferred[deferred_count].seq = seq;
+				deferred_count++;
+				return;
+			}
+		}
+		poll_workers(log_fh, -1);
+	}
+}
+
+
+void stop_workers(FILE *log_fh)
+{
+	if (worker_count < 1 && deferred_count < 1)
+		return;
+	if (verbose_mode)
+		fprintf(log_fh, "Waiting for %d workers to finish...\n", worker_count);
+
+	/* Wait for workers to finish current (and deferred) jobs... */
+	while (deferred_count > 0) {
+		start_deferred_jobs(log_fh);
+		if (deferred_count > 0)
+			poll_workers(log_fh, -1);
+	}
+	while (busy_count > 0)
+		poll_workers(log_fh, -1);
+
+	/* Closing job pipe tells worker to exit... */
+	for (int i = 0; i < max_workers; i++) {
+		if (workers[i].pid >= 0 && workers[i].write_pipe >= 0) {
+			close(workers[i].write_pipe);
+			workers[i].write_pipe = -1;
+		}
+	}
+	while (worker_count > 0)
+		poll_workers(log_fh, -1);
+}
+
+#endif /* PARALLEL_PROCESSING */
+
+/* eof :-) */